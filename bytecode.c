@@ -0,0 +1,698 @@
+#include "secd.h"
+#include "secd_io.h"
+#include "memory.h"
+#include "secdops.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ *  Bytecode files (.secdb)
+ *  a compiled control path and everything it refers to:
+ *    - the header;
+ *    - names of the opcodes used by the instructions;
+ *    - names of the symbols, each ends with '\0';
+ *    - objects: cells in an order where every object follows the
+ *      objects it refers to, the last one is the path itself.
+ *  An object is a tag byte and its payload. Numbers are LEB128 (7 bits
+ *  a byte, the high bit is set if more follow), signed ones are
+ *  zigzagged; a reference is 0 for NIL or how many objects back
+ *  the object is, so it's short. An instruction is its opcode and
+ *  its operand, the opcode is renumbered by name on loading, so a file
+ *  survives changes of opcode_table. The inline cache of a global LD
+ *  is only its depth, it's empty after loading, see emit_ldcache().
+ *  The header is in the host order.
+ */
+
+#define CODE_MAGIC "SECDB\0\0\1"
+
+typedef struct {
+    char magic[8];
+    uint32_t nops;
+    uint32_t nsyms;
+    uint32_t nobjs;
+    uint32_t symsize;   // the size of the symbol names
+    uint32_t objsize;   // the size of the objects
+} code_header_t;
+
+enum code_tag {
+    OBJ_INT,        // int32_t
+    OBJ_CHAR,       // int32_t
+    OBJ_SYM,        // the number of the symbol
+    OBJ_STR,        // the size and the bytes
+    OBJ_CONS,       // car and cdr
+    OBJ_CODE,       // the numbers of instructions and constants, then them
+};
+
+static bool is_code_object(const cell_t *c) {
+    switch (cell_type(c)) {
+      case CELL_INT: case CELL_CHAR: case CELL_SYM:
+      case CELL_STR: case CELL_CONS:
+        return true;
+      case CELL_ARRAY:
+        return is_control_compiled((cell_t *)c);
+      default:
+        return false;
+    }
+}
+
+static bool grow_to(void **buf, size_t *cap, size_t size, size_t itemsize) {
+    if (size <= *cap)
+        return true;
+    void *newbuf = realloc(*buf, size * itemsize);
+    if (!newbuf)
+        return false;
+    *buf = newbuf;
+    *cap = size;
+    return true;
+}
+
+/* marks the constants where inline caches of LD start, by the LD
+ * instructions for both saving and loading; constants are numbered
+ * from 1 in the path, ldcache[] from 0; false if a cache does not fit */
+static bool find_ldcaches(const instr_t *instrs, size_t len,
+                          bool *ldcache, size_t nconsts)
+{
+    memset(ldcache, 0, nconsts * sizeof(bool));
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if (instr_op(instrs[i]) != SECD_LD)
+            continue;
+        size_t at = instr_arg(instrs[i]) + LDCACHE_DEPTH;
+        if (at + LDCACHE_ENTRY - LDCACHE_DEPTH > nconsts)
+            return false;
+        ldcache[at - 1] = true;
+    }
+    return true;
+}
+
+/*
+ *  Writing
+ */
+
+/* a byte buffer */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t cap;
+} bytes_t;
+
+static bool put(bytes_t *b, const void *data, size_t size) {
+    if (b->size + size > b->cap) {
+        size_t newcap = 2 * (b->size + size);
+        char *newdata = realloc(b->data, newcap);
+        if (!newdata)
+            return false;
+        b->data = newdata;
+        b->cap = newcap;
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+    return true;
+}
+
+static bool put_num(bytes_t *b, uint32_t val) {
+    uint8_t buf[5];
+    size_t n = 0;
+    do {
+        buf[n] = val & 0x7f;
+        val >>= 7;
+        if (val)
+            buf[n] |= 0x80;
+        ++n;
+    } while (val);
+    return put(b, buf, n);
+}
+
+/* 0, -1, 1, -2, 2... to 0, 1, 2, 3, 4... */
+inline static uint32_t zigzag(int32_t val) {
+    return ((uint32_t)val << 1) ^ (uint32_t)(val >> 31);
+}
+inline static int32_t unzigzag(uint32_t val) {
+    return (int32_t)(val >> 1) ^ -(int32_t)(val & 1);
+}
+
+static bool put_tag(bytes_t *b, enum code_tag tag) {
+    uint8_t byte = tag;
+    return put(b, &byte, 1);
+}
+
+/* the numbers of the cells written, open addressing by address */
+typedef struct {
+    const cell_t **cells;
+    uint32_t *nums;
+    size_t size;
+    size_t count;
+} cellmap_t;
+
+static size_t cellmap_slot(const cellmap_t *map, const cell_t *c) {
+    size_t i = ((uintptr_t)c >> 4) * 2654435761u % map->size;
+    while (map->cells[i] && (map->cells[i] != c))
+        i = (i + 1) % map->size;
+    return i;
+}
+
+static uint32_t cellmap_get(const cellmap_t *map, const cell_t *c) {
+    if (!map->size)
+        return 0;
+    size_t i = cellmap_slot(map, c);
+    return (map->cells[i] ? map->nums[i] : 0);
+}
+
+static bool cellmap_put(cellmap_t *map, const cell_t *c, uint32_t num) {
+    if (2 * (map->count + 1) > map->size) {
+        cellmap_t bigger = { .size = (map->size ? 2 * map->size : 1024) };
+        bigger.cells = calloc(bigger.size, sizeof(cell_t *));
+        bigger.nums = malloc(bigger.size * sizeof(uint32_t));
+        if (!bigger.cells || !bigger.nums) {
+            free(bigger.cells); free(bigger.nums);
+            return false;
+        }
+        size_t i;
+        for (i = 0; i < map->size; ++i) {
+            if (!map->cells[i]) continue;
+            size_t j = cellmap_slot(&bigger, map->cells[i]);
+            bigger.cells[j] = map->cells[i];
+            bigger.nums[j] = map->nums[i];
+        }
+        bigger.count = map->count;
+        free(map->cells); free(map->nums);
+        *map = bigger;
+    }
+    size_t i = cellmap_slot(map, c);
+    map->cells[i] = c;
+    map->nums[i] = num;
+    ++map->count;
+    return true;
+}
+
+typedef struct {
+    secd_t *secd;
+    bytes_t objs;
+    bytes_t syms;
+    uint32_t nobjs;
+    uint32_t nsyms;
+    cellmap_t written;
+
+    bool usedops[SECD_LAST];
+
+    const cell_t **todo;    // cells waiting for what they refer to
+    size_t ntodo;
+    size_t todocap;
+
+    bool *ldcache;          // of the path being walked, see find_ldcaches()
+    size_t ldcachecap;
+} codewriter_t;
+
+/* symbols are written once, as the interned cell */
+static const cell_t *object_key(const cell_t *c) {
+    if (is_symbol(c) && !is_immediate(c))
+        return symdata(c)->cell;
+    return c;
+}
+
+/* the number of an object, 0 if it's not written yet */
+static uint32_t object_num(codewriter_t *w, const cell_t *c) {
+    if (is_nil(c))
+        return 0;
+    return cellmap_get(&w->written, object_key(c));
+}
+
+/* fills w->ldcache for the compiled path */
+static bool find_code_ldcaches(codewriter_t *w, const cell_t *code) {
+    size_t len = mem_size(arr_val(code, 0)) / sizeof(instr_t);
+    size_t nconsts = arr_size(w->secd, code) - 1;
+    return grow_to((void **)&w->ldcache, &w->ldcachecap, nconsts, sizeof(bool))
+        && find_ldcaches(code_instrs(code), len, w->ldcache, nconsts);
+}
+
+/* calls `fun` for every object `c` refers to, stops if it returns false */
+static bool for_object_refs(codewriter_t *w, const cell_t *c,
+                            bool (*fun)(codewriter_t *, const cell_t *))
+{
+    switch (cell_type(c)) {
+      case CELL_CONS:
+        return fun(w, get_car(c)) && fun(w, get_cdr(c));
+      case CELL_ARRAY: {
+        if (!find_code_ldcaches(w, c))
+            return false;
+        size_t i, size = arr_size(w->secd, c);
+        for (i = 1; i < size; ++i) {
+            if (w->ldcache[i - 1])
+                i += LDCACHE_ENTRY - LDCACHE_DEPTH;
+            else if (!fun(w, code_const(c, i)))
+                return false;
+        }
+        return true;
+      }
+      default:
+        return true;
+    }
+}
+
+static bool push_todo(codewriter_t *w, const cell_t *c) {
+    if (w->ntodo == w->todocap) {
+        size_t newcap = (w->todocap ? 2 * w->todocap : 256);
+        const cell_t **newtodo = realloc(w->todo, newcap * sizeof(cell_t *));
+        if (!newtodo)
+            return false;
+        w->todo = newtodo;
+        w->todocap = newcap;
+    }
+    w->todo[w->ntodo++] = c;
+    return true;
+}
+
+/* is the object written already? */
+static bool is_written(codewriter_t *w, const cell_t *c) {
+    return is_nil(c) || object_num(w, c);
+}
+
+static bool put_ref(codewriter_t *w, const cell_t *c) {
+    uint32_t num = object_num(w, c);
+    return put_num(&w->objs, (num ? w->nobjs + 1 - num : 0));
+}
+
+static bool write_object(codewriter_t *w, const cell_t *c) {
+    bytes_t *b = &w->objs;
+    bool ok = true;
+    switch (cell_type(c)) {
+      case CELL_INT:
+        ok = put_tag(b, OBJ_INT) && put_num(b, zigzag(numval(c)));
+        break;
+      case CELL_CHAR:
+        ok = put_tag(b, OBJ_CHAR) && put_num(b, numval(c));
+        break;
+      case CELL_SYM: {
+        const char *name = symname(c);
+        ok = put_tag(b, OBJ_SYM) && put_num(b, w->nsyms++)
+          && put(&w->syms, name, strlen(name) + 1);
+      } break;
+      case CELL_STR: {
+        size_t size = mem_size(c);
+        ok = put_tag(b, OBJ_STR) && put_num(b, size) && put(b, strval(c), size);
+      } break;
+      case CELL_CONS:
+        ok = put_tag(b, OBJ_CONS) && put_ref(w, get_car(c)) && put_ref(w, get_cdr(c));
+        break;
+      case CELL_ARRAY: {
+        const instr_t *instrs = code_instrs(c);
+        size_t n, len = mem_size(arr_val(c, 0)) / sizeof(instr_t);
+        ok = put_tag(b, OBJ_CODE) && put_num(b, len)
+          && put_num(b, arr_size(w->secd, c) - 1);
+        for (n = 0; ok && (n < len); ++n) {
+            opindex_t op = instr_op(instrs[n]);
+            w->usedops[op] = true;
+            ok = put_num(b, op | (zigzag(instr_arg(instrs[n])) << INSTR_OPBITS));
+        }
+        ok = ok && find_code_ldcaches(w, c);
+        size_t i, size = arr_size(w->secd, c);
+        for (i = 1; ok && (i < size); ++i) {
+            if (w->ldcache[i - 1]) {
+                ok = put_num(b, numval(code_const(c, i)));
+                i += LDCACHE_ENTRY - LDCACHE_DEPTH;
+            } else {
+                ok = put_ref(w, code_const(c, i));
+            }
+        }
+      } break;
+      default:
+        ok = false;
+    }
+    return ok && cellmap_put(&w->written, object_key(c), ++w->nobjs);
+}
+
+/* pushes an object to write before the one on top */
+static bool push_unwritten(codewriter_t *w, const cell_t *c) {
+    if (is_written(w, c))
+        return true;
+    if (!is_code_object(c)) {
+        errorf("save-code: a %s can't be saved\n", symname(secd_type_sym(w->secd, c)));
+        return false;
+    }
+    return push_todo(w, c);
+}
+
+static bool write_objects(codewriter_t *w, const cell_t *root) {
+    if (!push_unwritten(w, root))
+        return false;
+
+    while (w->ntodo > 0) {
+        const cell_t *c = w->todo[w->ntodo - 1];
+        if (is_written(w, c)) {
+            --w->ntodo;
+            continue;
+        }
+        if (!for_object_refs(w, c, is_written)) {
+            /* the objects it refers to go first */
+            if (!for_object_refs(w, c, push_unwritten))
+                return false;
+            continue;
+        }
+        if (!write_object(w, c))
+            return false;
+        --w->ntodo;
+    }
+    return true;
+}
+
+static bool write_code(codewriter_t *w, FILE *f) {
+    bytes_t ops = { .data = NULL };
+    uint32_t nops = 0;
+    int op;
+    for (op = 0; op < SECD_LAST; ++op) {
+        /* the unused ones have empty names */
+        const char *name = (w->usedops[op] ? opcode_table[op].name : "");
+        uint8_t len = strlen(name);
+        if (!put(&ops, &len, 1) || !put(&ops, name, len)) {
+            free(ops.data);
+            return false;
+        }
+        ++nops;
+    }
+
+    code_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CODE_MAGIC, sizeof(hdr.magic));
+    hdr.nops = nops;
+    hdr.nsyms = w->nsyms;
+    hdr.nobjs = w->nobjs;
+    hdr.symsize = w->syms.size;
+    hdr.objsize = w->objs.size;
+
+    bool ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1)
+           && (fwrite(ops.data, 1, ops.size, f) == ops.size)
+           && (fwrite(w->syms.data, 1, w->syms.size, f) == w->syms.size)
+           && (fwrite(w->objs.data, 1, w->objs.size, f) == w->objs.size);
+    free(ops.data);
+    return ok;
+}
+
+bool secd_save_code(secd_t *secd, cell_t *ctrl, const char *path) {
+    share_cell(secd, ctrl);
+    compile_ctrl(secd, &ctrl, SECD_NIL);
+    if (is_error(ctrl) || !is_control_compiled(ctrl)) {
+        errorf("save-code: not a control path\n");
+        return false;
+    }
+
+    codewriter_t w;
+    memset(&w, 0, sizeof(w));
+    w.secd = secd;
+    bool ok = write_objects(&w, ctrl);
+
+    if (ok) {
+        FILE *f = fopen(path, "wb");
+        if (!f) {
+            errorf("save-code: %s: %s\n", path, strerror(errno));
+            ok = false;
+        } else {
+            ok = write_code(&w, f);
+            if (fclose(f))
+                ok = false;
+            if (!ok)
+                errorf("save-code: failed to write %s\n", path);
+        }
+    }
+
+    free(w.objs.data);
+    free(w.syms.data);
+    free(w.written.cells);
+    free(w.written.nums);
+    free(w.todo);
+    free(w.ldcache);
+    drop_cell(secd, ctrl);
+    return ok;
+}
+
+/*
+ *  Loading
+ */
+
+typedef struct {
+    secd_t *secd;
+    const char *pos;
+    const char *end;
+    bool ok;
+
+    opindex_t *ops;     // opcodes by the numbers of the file
+    uint32_t nops;
+    cell_t **syms;
+    uint32_t nsyms;
+    cell_t **objs;
+    uint32_t nobjs;     // loaded so far
+
+    instr_t *instrs;    // of the path being loaded
+    size_t instrcap;
+    cell_t **consts;
+    size_t constcap;
+    bool *ldcache;      // where inline caches of LD start
+    size_t ldcachecap;
+} codereader_t;
+
+static const char *get(codereader_t *r, size_t size) {
+    if ((size_t)(r->end - r->pos) < size) {
+        r->ok = false;
+        return NULL;
+    }
+    const char *data = r->pos;
+    r->pos += size;
+    return data;
+}
+
+static uint32_t get_num(codereader_t *r) {
+    uint32_t val = 0;
+    int shift;
+    for (shift = 0; shift < 35; shift += 7) {
+        const char *byte = get(r, 1);
+        if (!byte)
+            return 0;
+        val |= (uint32_t)(*byte & 0x7f) << shift;
+        if (!(*byte & 0x80))
+            return val;
+    }
+    r->ok = false;
+    return 0;
+}
+
+static cell_t *read_ref(codereader_t *r) {
+    uint32_t back = get_num(r);
+    if (!back)
+        return SECD_NIL;
+    if (back > r->nobjs) {
+        r->ok = false;
+        return SECD_NIL;
+    }
+    return r->objs[r->nobjs - back];
+}
+
+/* checks operands of the instruction and renumbers its opcode */
+static bool load_instr(codereader_t *r, instr_t *instr, size_t pos,
+                       size_t len, size_t nconsts)
+{
+    uint32_t op = instr_op(*instr);
+    if (op >= r->nops || r->ops[op] == SECD_LAST)
+        return false;
+    opindex_t opind = r->ops[op];
+    int arg = instr_arg(*instr);
+
+    if ((opind == SECD_SEL) || (opind == SECD_JOIN)) {
+        long target = (long)pos + 1 + arg;
+        if ((target < 0) || (target > (long)len))
+            return false;
+    } else if (opcode_table[opind].args > 0) {
+        /* LD, LDC and LDF refer to constants */
+        if ((arg < 1) || ((size_t)arg > nconsts))
+            return false;
+    }
+    *instr = make_instr(opind, arg);
+    return true;
+}
+
+static cell_t *load_code(codereader_t *r) {
+    uint32_t len = get_num(r);
+    uint32_t nconsts = get_num(r);
+    /* each takes a byte at least, but a cache of LD writes only its depth */
+    if (!r->ok
+        || ((size_t)(r->end - r->pos)
+            < (size_t)len + (nconsts + LDCACHE_ENTRY - 1) / LDCACHE_ENTRY)
+        || !grow_to((void **)&r->instrs, &r->instrcap, len, sizeof(instr_t))
+        || !grow_to((void **)&r->consts, &r->constcap, nconsts, sizeof(cell_t *))
+        || !grow_to((void **)&r->ldcache, &r->ldcachecap, nconsts, sizeof(bool)))
+    {
+        r->ok = false;
+        return SECD_NIL;
+    }
+
+    size_t i;
+    for (i = 0; r->ok && (i < len); ++i) {
+        uint32_t num = get_num(r);
+        r->instrs[i] = make_instr(num & ((1 << INSTR_OPBITS) - 1),
+                                  unzigzag(num >> INSTR_OPBITS));
+    }
+    for (i = 0; r->ok && (i < len); ++i)
+        r->ok = load_instr(r, &r->instrs[i], i, len, nconsts);
+
+    r->ok = r->ok && find_ldcaches(r->instrs, len, r->ldcache, nconsts);
+
+    for (i = 0; r->ok && (i < nconsts); ++i) {
+        if (!r->ldcache[i]) {
+            r->consts[i] = read_ref(r);
+            continue;
+        }
+        r->consts[i] = new_number(r->secd, get_num(r));
+        r->consts[++i] = new_number(r->secd, 0);
+        r->consts[++i] = new_frame(r->secd, SECD_NIL, SECD_NIL);
+    }
+    if (!r->ok)
+        return SECD_NIL;
+    return new_code(r->secd, r->instrs, len, r->consts, nconsts);
+}
+
+static cell_t *load_object(codereader_t *r) {
+    secd_t *secd = r->secd;
+    const char *tag = get(r, 1);
+    if (!tag)
+        return SECD_NIL;
+
+    switch (*tag) {
+      case OBJ_INT:
+        return new_number(secd, unzigzag(get_num(r)));
+      case OBJ_CHAR:
+        return new_char(secd, get_num(r));
+      case OBJ_SYM: {
+        uint32_t num = get_num(r);
+        if (num >= r->nsyms)
+            break;
+        return r->syms[num];
+      }
+      case OBJ_STR: {
+        uint32_t size = get_num(r);
+        const char *data = get(r, size);
+        if (!data)
+            break;
+        cell_t *str = new_string_of_size(secd, size);
+        if (!is_error(str))
+            memcpy(strmem(str), data, size);
+        return str;
+      }
+      case OBJ_CONS: {
+        cell_t *car = read_ref(r);
+        cell_t *cdr = read_ref(r);
+        if (!r->ok)
+            break;
+        return new_cons(secd, car, cdr);
+      }
+      case OBJ_CODE:
+        return load_code(r);
+    }
+    r->ok = false;
+    return SECD_NIL;
+}
+
+static bool load_names(codereader_t *r, const code_header_t *hdr) {
+    r->ops = malloc(hdr->nops * sizeof(opindex_t));
+    r->syms = malloc(hdr->nsyms * sizeof(cell_t *));
+    r->objs = malloc(hdr->nobjs * sizeof(cell_t *));
+    if (!r->ops || !r->syms || !r->objs)
+        return false;
+
+    char name[256];
+    for (r->nops = 0; r->nops < hdr->nops; ++r->nops) {
+        const uint8_t *len = (const uint8_t *)get(r, 1);
+        const char *data = (len ? get(r, *len) : NULL);
+        if (!data)
+            return false;
+        memcpy(name, data, *len);
+        name[*len] = '\0';
+
+        index_t opind = (*len ? opcode_for_name(name) : -1);
+        r->ops[r->nops] = (opind >= 0 ? (opindex_t)opind : SECD_LAST);
+    }
+
+    const char *end = r->pos + hdr->symsize;
+    if (end > r->end)
+        return false;
+    for (r->nsyms = 0; r->nsyms < hdr->nsyms; ++r->nsyms) {
+        const char *sym = r->pos;
+        const char *symend = memchr(sym, '\0', end - sym);
+        if (!symend)
+            return false;
+        r->pos = symend + 1;
+
+        cell_t *cell = new_symbol(r->secd, sym);
+        if (is_error(cell))
+            return false;
+        r->syms[r->nsyms] = cell;
+    }
+    return (r->pos == end);
+}
+
+static cell_t *load_from(secd_t *secd, const char *data, size_t size) {
+    code_header_t hdr;
+    if ((size < sizeof(hdr)) || memcmp(data, CODE_MAGIC, sizeof(hdr.magic)))
+        return new_error(secd, "not a bytecode file");
+    memcpy(&hdr, data, sizeof(hdr));
+
+    codereader_t r;
+    memset(&r, 0, sizeof(r));
+    r.secd = secd;
+    r.pos = data + sizeof(hdr);
+    r.end = data + size;
+    /* each takes a byte at least; one by one, a sum of them may wrap */
+    r.ok = hdr.nobjs && (hdr.nops <= size) && (hdr.nsyms <= size - hdr.nops)
+        && (hdr.nobjs <= size - hdr.nops - hdr.nsyms)
+        && load_names(&r, &hdr);
+
+    for (r.nobjs = 0; r.ok && (r.nobjs < hdr.nobjs); ++r.nobjs) {
+        cell_t *obj = load_object(&r);
+        if (is_error(obj))
+            r.ok = false;
+        r.objs[r.nobjs] = obj;
+    }
+
+    cell_t *ctrl = (r.ok ? r.objs[hdr.nobjs - 1] : SECD_NIL);
+    free(r.ops); free(r.syms); free(r.objs);
+    free(r.instrs); free(r.consts); free(r.ldcache);
+
+    if (!(r.ok && (r.pos == r.end) && is_control_compiled(ctrl)))
+        return new_error(secd, "the bytecode is damaged");
+    return ctrl;
+}
+
+bool is_code_file(const char *path) {
+    char magic[sizeof(((code_header_t *)0)->magic)];
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+    bool ok = (fread(magic, sizeof(magic), 1, f) == 1)
+           && !memcmp(magic, CODE_MAGIC, sizeof(magic));
+    fclose(f);
+    return ok;
+}
+
+cell_t *secd_load_code(secd_t *secd, const char *path) {
+    FILE *f = fopen(path, "rb");
+    assert(f, "load-code: %s: %s", path, strerror(errno));
+
+    /* read at once, the loader does not wait for I/O */
+    char *data = NULL;
+    size_t size = 0, cap = 0;
+    while (!ferror(f) && !feof(f)) {
+        if (size == cap) {
+            cap = (cap ? 2 * cap : 64 * 1024);
+            char *newdata = realloc(data, cap);
+            if (!newdata) break;
+            data = newdata;
+        }
+        size += fread(data + size, 1, cap - size, f);
+    }
+    bool ok = !ferror(f) && feof(f);
+    fclose(f);
+
+    cell_t *ctrl = (ok ? load_from(secd, data, size)
+                       : new_error(secd, "load-code: %s: failed to read", path));
+    free(data);
+    return ctrl;
+}
@@ -1,16 +1,34 @@
 #ifndef __SECD_CONF_H___
 #define __SECD_CONF_H___
 
-#define N_CELLS     256 * 1024
+#define N_CELLS     256 * 1024          /* initial size of the heap */
+#define MAX_CELLS   32 * 1024 * 1024    /* the heap does not grow over this */
+#define NURSERY_CELLS  64 * 1024        /* young cells between minor GCs */
+#define GC_CELLS    128 * 1024          /* old cells before the first automatic GC */
+#define GC_FREE     50                  /* percent of the old cells free at the next GC */
+#define GC_GAP      10                  /* percent of the heap left unused to GC at */
+#define GC_RESERVE  16 * 1024           /* cells to finish an instruction on a full heap */
+#define GC_COMPACT  25                  /* percent of the array area free to compact it */
 
 #define TAILRECURSION 1
+
+/* direct-threaded dispatch with computed goto (a GNU C extension);
+ * build with -DTHREADED_CODE=0 to get the portable opcode_table loop */
+#ifndef THREADED_CODE
+# if defined(__GNUC__)
+#  define THREADED_CODE 1
+# else
+#  define THREADED_CODE 0
+# endif
+#endif
 #define CASESENSITIVE 0
 
 #define TYPE_BITS  8
-#define NREF_BITS  (8 * sizeof(size_t) - TYPE_BITS)
+#define FLAG_BITS  16
+#define NREF_BITS  (8 * sizeof(size_t) - TYPE_BITS - FLAG_BITS)
 
 #define EOF_OBJ     "#<eof>"
-#define DONT_FREE_THIS  (1ul << (8 * sizeof(size_t) - TYPE_BITS - 2))
+#define DONT_FREE_THIS  (1ul << (NREF_BITS - 2))
 
 #if CASESENSITIVE
 # define str_eq(s1, s2)  !strcmp(s1, s2)
@@ -5,9 +5,19 @@
 
 #include <string.h>
 
-static hash_t stdinhash;
-static hash_t stdouthash;
-static hash_t modulehash;
+/* the interned names, symbols are compared by them */
+static const symdata_t *stdin_name;
+static const symdata_t *stdout_name;
+static const symdata_t *stddbg_name;
+static const symdata_t *module_name;
+
+inline static bool is_name(const cell_t *sym, const symdata_t *name) {
+    return !is_immediate(sym) && (symdata(sym)->folded == name);
+}
+
+static const symdata_t *intern_name(secd_t *secd, const char *name) {
+    return symdata(new_symbol(secd, name))->folded;
+}
 
 /*
  *  Environment
@@ -64,33 +74,39 @@ cell_t *make_native_frame(secd_t *secd,
     return new_frame(secd, symlist, vallist);
 }
 
+void init_env_names(secd_t *secd) {
+    stdin_name = intern_name(secd, SECD_FAKEVAR_STDIN);
+    stdout_name = intern_name(secd, SECD_FAKEVAR_STDOUT);
+    stddbg_name = intern_name(secd, SECD_FAKEVAR_STDDBG);
+    module_name = intern_name(secd, SECD_FAKEVAR_MODULE);
+}
+
 void init_env(secd_t *secd) {
     /* initialize global values */
-    stdinhash = strhash(SECD_FAKEVAR_STDIN);
-    stdouthash = strhash(SECD_FAKEVAR_STDOUT);
-    modulehash = strhash(SECD_FAKEVAR_MODULE);
+    init_env_names(secd);
     secd->envcounter = 0;
+    secd->envversion = 1;
+    secd->io_frames = 0;
 
     /* initialize the first frame */
     cell_t *frame = make_native_frame(secd, native_functions, ":secd");
 
-    cell_t *frame_io = new_cons(secd, secd->input_port, secd->output_port);
-    frame->as.frame.io = share_cell(secd, frame_io);
+    cell_t *default_io = new_cons(secd, secd->input_port, secd->output_port);
+    secd->default_io = share_cell(secd, default_io);
 
     /* ready */
     cell_t *env = new_cons(secd, frame, SECD_NIL);
 
-    secd->env = share_cell(secd, env);
+    secd->env = env;
     secd->global_env = secd->env;
 }
 
-static cell_t *lookup_fake_variables(secd_t *secd, const char *sym) {
-    hash_t symh = strhash(sym);
-    if ((symh == stdinhash) && str_eq(sym, SECD_FAKEVAR_STDIN))
+static cell_t *lookup_fake_variables(secd_t *secd, const cell_t *sym) {
+    if (is_name(sym, stdin_name))
         return secd->input_port;
-    if ((symh == stdouthash) && str_eq(sym, SECD_FAKEVAR_STDOUT))
+    if (is_name(sym, stdout_name))
         return secd->output_port;
-    if ((symh == modulehash) && str_eq(sym, SECD_FAKEVAR_STDDBG))
+    if (is_name(sym, stddbg_name))
         return secd->debug_port;
     return SECD_NIL;
 }
@@ -104,9 +120,7 @@ static const char *module_name_for_frame(secd_t *secd, cell_t *frame, bool *open
     cell_t *vallist = get_cdr(frame);
     while (not_nil(symlist)) {
         cell_t *sym = list_head(symlist);
-        if ((symhash(sym) == modulehash)
-            && str_eq(SECD_FAKEVAR_MODULE, symname(sym)))
-        {
+        if (is_name(sym, module_name)) {
             cell_t *mod = list_head(vallist);
             if (!is_symbol(mod)) {
                 errorf("Module name is not a symbol");
@@ -127,12 +141,13 @@ static const char *module_name_for_frame(secd_t *secd, cell_t *frame, bool *open
     return NULL;
 }
 
-static bool name_eq(const char *sym, hash_t symh, cell_t *cursym,
+static bool name_eq(const cell_t *symc, cell_t *cursym,
         const char *modname, size_t modlen, bool open)
 {
-    const char *cur = symname(cursym);
-    if (open && (symh == symhash(cursym)) && str_eq(cur, sym))
+    if (open && sym_eq(symc, cursym))
         return true;
+    const char *sym = symname(symc);
+    const char *cur = symname(cursym);
     if (sym[modlen] != ':')
         return false;
     if (!strncmp(sym, modname, modlen - 1)) {
@@ -142,20 +157,24 @@ static bool name_eq(const char *sym, hash_t symh, cell_t *cursym,
     return false;
 }
 
-cell_t *lookup_env(secd_t *secd, const char *symbol, cell_t **symc) {
+/* binding: the list of values starting with the found one,
+ * NIL if the variable is fake or a frame of DUM has been passed */
+static cell_t *
+lookup_in_env(secd_t *secd, const cell_t *sym, cell_t **symc, cell_t **binding) {
     cell_t *env = secd->env;
+    bool dummy = false;
     assert(cell_type(env) == CELL_CONS,
             "lookup_env: environment is not a list\n");
 
-    cell_t *res = lookup_fake_variables(secd, symbol);
+    cell_t *res = lookup_fake_variables(secd, sym);
     if (not_nil(res)) {
         return res;
     }
-    hash_t symh = strhash(symbol);
 
     while (not_nil(env)) {       // walk through frames
         cell_t *frame = get_car(env);
         if (is_nil(frame)) {
+            dummy = true;
             env = list_next(secd, env);
             continue;
         }
@@ -172,13 +191,15 @@ cell_t *lookup_env(secd_t *secd, const char *symbol, cell_t **symc) {
                    "lookup_env: variable at [%ld] is not a symbol\n", cell_index(secd, curc));
 
             if (mod) {
-                if (name_eq(symbol, symh, curc, mod, modlen, open)) {
+                if (name_eq(sym, curc, mod, modlen, open)) {
                     if (symc != NULL) *symc = curc;
+                    if (binding != NULL) *binding = (dummy ? SECD_NIL : vallist);
                     return get_car(vallist);
                 }
             } else {
-                if (symh == symhash(curc) && str_eq(symbol, symname(curc))) {
+                if (sym_eq(sym, curc)) {
                     if (symc != NULL) *symc = curc;
+                    if (binding != NULL) *binding = (dummy ? SECD_NIL : vallist);
                     return get_car(vallist);
                 }
             }
@@ -189,16 +210,25 @@ cell_t *lookup_env(secd_t *secd, const char *symbol, cell_t **symc) {
 
         env = list_next(secd, env);
     }
-    errorf("lookup_env: %s not found\n", symbol);
-    return new_error(secd, "lookup failed for: '%s'", symbol);
+    errorf("lookup_env: %s not found\n", symname(sym));
+    return new_error(secd, "lookup failed for: '%s'", symname(sym));
+}
+
+cell_t *lookup_env(secd_t *secd, const cell_t *sym, cell_t **symc) {
+    return lookup_in_env(secd, sym, symc, NULL);
 }
 
-cell_t *lookup_symenv(secd_t *secd, const char *symbol) {
+cell_t *lookup_binding(secd_t *secd, const cell_t *sym, cell_t **binding) {
+    *binding = SECD_NIL;
+    return lookup_in_env(secd, sym, NULL, binding);
+}
+
+cell_t *lookup_symenv(secd_t *secd, const cell_t *sym) {
     cell_t *env = secd->env;
     assert(cell_type(env) == CELL_CONS,
             "lookup_symbol: environment is not a list\n");
 
-    cell_t *res = lookup_fake_variables(secd, symbol);
+    cell_t *res = lookup_fake_variables(secd, sym);
     if (not_nil(res))
         return res;
 
@@ -211,7 +241,7 @@ cell_t *lookup_symenv(secd_t *secd, const char *symbol) {
             assert(is_symbol(cur_sym),
                     "lookup_symbol: variable at [%ld] is not a symbol\n", cell_index(secd, cur_sym));
 
-            if (str_eq(symbol, symname(cur_sym))) {
+            if (sym_eq(sym, cur_sym)) {
                 return cur_sym;
             }
             symlist = list_next(secd, symlist);
@@ -222,39 +252,69 @@ cell_t *lookup_symenv(secd_t *secd, const char *symbol) {
     return SECD_NIL;
 }
 
-static cell_t *new_frame_io(secd_t *secd, cell_t *frame, cell_t *prevenv) {
-    /* check if there are *stdin* or *stdout* in new frame */
-    cell_t *frame_io = SECD_NIL;
+/* ports bound to *stdin* and *stdout* in the frame, if not found yet */
+static void frame_ports(secd_t *secd, cell_t *frame, cell_t **in, cell_t **out) {
+    cell_t *symlist = get_car(frame);
+    cell_t *vallist = get_cdr(frame);
+
+    while (not_nil(symlist)) {
+        cell_t *sym = get_car(symlist);
+        if (is_nil(*in) && is_name(sym, stdin_name))
+            *in = get_car(vallist);
+        else
+        if (is_nil(*out) && is_name(sym, stdout_name))
+            *out = get_car(vallist);
+
+        symlist = list_next(secd, symlist);
+        vallist = list_next(secd, vallist);
+    }
+}
+
+/* frames don't keep their I/O: it is the innermost binding of
+ * *stdin* and *stdout* in the frame and its environment */
+static void set_frame_io(secd_t *secd, cell_t *frame, cell_t *env) {
+    cell_t *in = SECD_NIL;
+    cell_t *out = SECD_NIL;
+    while (secd->io_frames > 0) {
+        if (not_nil(frame) && (frame->flags & FLAG_FRAMEIO))
+            frame_ports(secd, frame, &in, &out);
+        if ((not_nil(in) && not_nil(out)) || is_nil(env))
+            break;
+        frame = get_car(env);
+        env = list_next(secd, env);
+    }
+    secd->input_port = (not_nil(in) ? in : get_car(secd->default_io));
+    secd->output_port = (not_nil(out) ? out : get_cdr(secd->default_io));
+}
+
+inline static void flag_frame_io(secd_t *secd, cell_t *frame) {
+    if (frame->flags & FLAG_FRAMEIO)
+        return;
+    frame->flags |= FLAG_FRAMEIO;
+    ++secd->io_frames;
+}
+
+/* flags the frame if it binds *stdin* or *stdout* */
+static cell_t *check_frame_io(secd_t *secd, cell_t *frame) {
     cell_t *symlist = get_car(frame);
     cell_t *vallist = get_cdr(frame);
 
     if (is_symbol(symlist)) {
-        frame->as.cons.car = share_cell(secd, new_cons(secd, symlist, SECD_NIL));
-        frame->as.cons.cdr = share_cell(secd, new_cons(secd, vallist, SECD_NIL));
+        set_car(secd, frame, share_cell(secd, new_cons(secd, symlist, SECD_NIL)));
+        set_cdr(secd, frame, share_cell(secd, new_cons(secd, vallist, SECD_NIL)));
         drop_cell(secd, symlist); drop_cell(secd, vallist);
     } else
     while (not_nil(symlist)) {
         cell_t *sym = get_car(symlist);
-        hash_t symh = symhash(sym);
-        if ((symh == stdinhash)
-            && str_eq(symname(sym), SECD_FAKEVAR_STDIN))
-        {
+        if (is_name(sym, stdin_name)) {
             cell_t *val = get_car(vallist);
             assert(cell_type(val) == CELL_PORT, "*stdin* must bind a port");
-            if (is_nil(frame_io))
-                frame_io = new_cons(secd, val, SECD_NIL);
-            else
-                frame_io->as.cons.car = share_cell(secd, val);
+            flag_frame_io(secd, frame);
         } else
-        if ((symh == stdouthash)
-            && str_eq(symname(sym), SECD_FAKEVAR_STDOUT))
-        {
+        if (is_name(sym, stdout_name)) {
             cell_t *val = get_car(vallist);
             assert(cell_type(val) == CELL_PORT, "*stdout* must bind a port");
-            if (is_nil(frame_io))
-                frame_io = new_cons(secd, SECD_NIL, val);
-            else
-                frame_io->as.cons.cdr = share_cell(secd, val);
+            flag_frame_io(secd, frame);
         }
 
         cell_t *nextsyms = list_next(secd, symlist);
@@ -262,8 +322,8 @@ static cell_t *new_frame_io(secd_t *secd, cell_t *frame, cell_t *prevenv) {
 
         /* dot-lists of arguments? */
         if (is_symbol(nextsyms)) {
-            symlist->as.cons.cdr = share_cell(secd, new_cons(secd, nextsyms, SECD_NIL));
-            vallist->as.cons.cdr = share_cell(secd, new_cons(secd, nextvals, SECD_NIL));
+            set_cdr(secd, symlist, share_cell(secd, new_cons(secd, nextsyms, SECD_NIL)));
+            set_cdr(secd, vallist, share_cell(secd, new_cons(secd, nextvals, SECD_NIL)));
             drop_cell(secd, nextsyms); drop_cell(secd, nextvals);
             break;
         }
@@ -271,21 +331,13 @@ static cell_t *new_frame_io(secd_t *secd, cell_t *frame, cell_t *prevenv) {
         symlist = nextsyms;
         vallist = nextvals;
     }
-    cell_t *prev_io = get_car(prevenv)->as.frame.io;
-    if (is_nil(frame_io))
-        return prev_io;
-
-    if (is_nil(get_car(frame_io)))
-        frame_io->as.cons.car = share_cell(secd, get_car(prev_io));
-    if (is_nil(get_cdr(frame_io)))
-        frame_io->as.cons.cdr = share_cell(secd, get_cdr(prev_io));
-    return frame_io;
+    return frame;
 }
 
 cell_t *setup_frame(secd_t *secd, cell_t *argnames, cell_t *argvals, cell_t *env) {
     /* insert *module* variable into the new frame
     cell_t *modsym = SECD_NIL;
-    if (is_error(lookup_env(secd, SECD_FAKEVAR_MODULE, &modsym)))
+    if (is_error(lookup_env(secd, new_symbol(secd, SECD_FAKEVAR_MODULE), &modsym)))
         return new_error(secd, "there's no *module* variable");
 
     char envname[64];   // determine name for the frame
@@ -297,18 +349,73 @@ cell_t *setup_frame(secd_t *secd, cell_t *argnames, cell_t *argvals, cell_t *env
 
     /* setup the new frame */
     cell_t *frame = new_frame(secd, argnames, argvals);
+    assert_cell(frame, "setup_frame: no memory for a frame");
+
+    cell_t *res = check_frame_io(secd, frame);
+    assert_cell(res, "setup_frame: failed to set new frame I/O\n");
+
+    set_frame_io(secd, frame, env);
+    return frame;
+}
 
-    cell_t *new_io = new_frame_io(secd, frame, env);
-    assert_cell(new_io, "setup_frame: failed to set new frame I/O\n");
+/* the head is shared once when the list is created */
+static void append_to_frame_list(secd_t *secd, cell_t **head, cell_t **tail, cell_t *val) {
+    cell_t *cons = new_cons(secd, val, SECD_NIL);
+    if (is_nil(*head))
+        *head = share_cell(secd, cons);
+    else
+        set_cdr(secd, *tail, share_cell(secd, cons));
+    *tail = cons;
+}
+
+/* local frames are addressed by (depth . index) in compiled code (LDLOC):
+ * rebinding replaces the value, a new variable goes to the end, so that
+ * the indices compiled before stay valid. The lists are copied, not
+ * changed in place: the names are the formal arguments of the function,
+ * shared by all its frames, and the values may be an argument list that
+ * someone else holds. This makes N local defines cost O(N^2), bodies
+ * have a few of them. */
+static cell_t *rebind_in_local_frame(secd_t *secd, cell_t *frame, cell_t *sym, cell_t *val) {
+    cell_t *old_syms = get_car(frame);
+    cell_t *old_vals = get_cdr(frame);
 
-    frame->as.frame.io = share_cell(secd, new_io);
-    secd->input_port = get_car(new_io);
-    secd->output_port = get_cdr(new_io);
+    cell_t *new_syms = SECD_NIL, *symtail = SECD_NIL;
+    cell_t *new_vals = SECD_NIL, *valtail = SECD_NIL;
+    bool found = false;
+
+    cell_t *cursym = old_syms;
+    cell_t *curval = old_vals;
+    while (not_nil(cursym)) {
+        cell_t *s = get_car(cursym);
+        cell_t *v = (not_nil(curval) ? get_car(curval) : SECD_NIL);
+        if (!found && sym_eq(s, sym)) {
+            v = val;
+            found = true;
+        }
+        append_to_frame_list(secd, &new_syms, &symtail, s);
+        append_to_frame_list(secd, &new_vals, &valtail, v);
 
+        cursym = list_next(secd, cursym);
+        curval = (not_nil(curval) ? list_next(secd, curval) : SECD_NIL);
+    }
+    if (!found) {
+        append_to_frame_list(secd, &new_syms, &symtail, sym);
+        append_to_frame_list(secd, &new_vals, &valtail, val);
+    }
+
+    set_car(secd, frame, new_syms);
+    set_cdr(secd, frame, new_vals);
+    drop_cell(secd, old_syms); drop_cell(secd, old_vals);
     return frame;
 }
 
 cell_t *secd_insert_in_frame(secd_t *secd, cell_t *frame, cell_t *sym, cell_t *val) {
+    /* cached lookups are not valid anymore */
+    ++secd->envversion;
+
+    if (frame != get_car(secd->global_env))
+        return rebind_in_local_frame(secd, frame, sym, val);
+
     cell_t *old_syms = get_car(frame);
     cell_t *old_vals = get_cdr(frame);
 
@@ -316,8 +423,8 @@ cell_t *secd_insert_in_frame(secd_t *secd, cell_t *frame, cell_t *sym, cell_t *v
     // re-binding an existing symbol, we can create multiple
     // copies of it on the frame, the last added is found
     // during value lookup, but the old ones are persistent
-    frame->as.cons.car = share_cell(secd, new_cons(secd, sym, old_syms));
-    frame->as.cons.cdr = share_cell(secd, new_cons(secd, val, old_vals));
+    set_car(secd, frame, share_cell(secd, new_cons(secd, sym, old_syms)));
+    set_cdr(secd, frame, share_cell(secd, new_cons(secd, val, old_vals)));
 
     drop_cell(secd, old_syms); drop_cell(secd, old_vals);
     return frame;
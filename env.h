@@ -17,11 +17,14 @@ cell_t * make_frame_of_natives(secd_t *secd);
 
 void print_env(secd_t *secd);
 void init_env(secd_t *secd);
+/* the names env.c compares symbols with, e.g. after loading an image */
+void init_env_names(secd_t *secd);
 
 cell_t *setup_frame(secd_t *secd, cell_t *argnames, cell_t *argsvals, cell_t *env);
 cell_t *secd_insert_in_frame(secd_t *secd, cell_t *frame, cell_t *sym, cell_t *val);
 
-cell_t *lookup_env(secd_t *secd, const char *symbol, cell_t **symc);
-cell_t *lookup_symenv(secd_t *secd, const char *symbol);
+cell_t *lookup_env(secd_t *secd, const cell_t *sym, cell_t **symc);
+cell_t *lookup_binding(secd_t *secd, const cell_t *sym, cell_t **binding);
+cell_t *lookup_symenv(secd_t *secd, const cell_t *sym);
 
 #endif //__SECD_ENV_H__
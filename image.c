@@ -0,0 +1,610 @@
+#include "secd.h"
+#include "secd_io.h"
+#include "memory.h"
+#include "env.h"
+#include "secdops.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ *  Images
+ *  the machine is saved after a mark & sweep, between instructions:
+ *  the nursery is empty, the old cells and the arrays are written
+ *  as they are, since cells refer to each other by offsets;
+ *  only the payloads that are C pointers are replaced:
+ *    - CELL_SYM: the number of its name in the symbol table,
+ *    - CELL_ERROR: the message follows the cells,
+ *    - CELL_FUNC: the index in native_functions[],
+ *    - CELL_PORT: 1..3 for stdin/stdout/stderr, other files are closed.
+ *  The registers, the stack and the dump keep cell_ref() offsets.
+ *  An image is only good for the binary that saved it.
+ *  The Makefile links images of scm2secd.secd and repl.secd into
+ *  the binary, see secd_load_builtin().
+ */
+
+#define IMAGE_MAGIC "SECDIMG1"
+
+typedef struct {
+    char magic[8];
+    uint32_t cellsize;
+    uint32_t nnatives;      // the length of native_functions[]
+
+    /* the heap, in cells from secd->begin */
+    uint64_t heapsize;
+    uint64_t nursery;
+    uint64_t fixedptr;
+    uint64_t fixedlimit;
+    uint64_t arraylimit;
+    uint64_t arrayptr;
+
+    /* the registers */
+    cellref_t env;
+    cellref_t control;
+    uint64_t ipoffset;
+    cellref_t free;
+    cellref_t global_env;
+    cellref_t arrfree[ARR_CLASSES];
+    uint64_t arrfree_map;
+    cellref_t input_port;
+    cellref_t output_port;
+    cellref_t debug_port;
+    cellref_t default_io;
+    cellref_t type_syms[CELL_ERROR + 1];
+    cellref_t truth_value;
+    cellref_t false_value;
+    uint64_t io_frames;
+    uint64_t free_cells;
+    uint64_t tick;
+    int64_t envcounter;
+    int64_t envversion;
+
+    /* the sections after the cells */
+    uint64_t stackbase;
+    uint64_t nstack;        // cellref_t each
+    uint64_t ndump;         // image_frame_t each
+    uint64_t nzct;          // cellref_t each
+    uint64_t nsyms;         // a cellref_t, a length and the name each
+    uint64_t msgsize;       // messages of errors, each ends with '\0'
+} image_header_t;
+
+typedef struct {
+    cellref_t control;
+    cellref_t env;
+    cellref_t input_port;
+    cellref_t output_port;
+    uint64_t ipoffset;
+    uint64_t stackbase;
+} image_frame_t;
+
+/* the state of saving or loading */
+typedef struct {
+    cell_t *fixed;      // copies of the cells to write, NULL when loading
+    cell_t *arrays;
+
+    char *msgs;         // error messages in the order of the cells
+    size_t msgsize;
+    size_t msgcap;
+    size_t msgpos;
+
+    const char **names; // loading: names of interned symbols by number
+    bool ok;
+} image_t;
+
+static size_t native_count(void) {
+    size_t n = 0;
+    while (native_functions[n].name)
+        ++n;
+    return n;
+}
+
+/* the index in native_functions[] of a CELL_FUNC, -1 if none */
+static int native_index(const cell_t *func) {
+    int i;
+    for (i = 0; native_functions[i].name; ++i) {
+        const cell_t *val = native_functions[i].val;
+        if ((cell_type(val) == CELL_FUNC) && (val->as.ptr == func->as.ptr))
+            return i;
+    }
+    return -1;
+}
+
+static FILE *std_file(int index) {
+    switch (index) {
+      case 1: return stdin;
+      case 2: return stdout;
+      case 3: return stderr;
+      default: return NULL;
+    }
+}
+
+static int std_index(const FILE *f) {
+    int i;
+    for (i = 1; i <= 3; ++i)
+        if (f && (f == std_file(i)))
+            return i;
+    return 0;
+}
+
+/* calls `fun` for every fixed cell and every item of arrays of cells */
+static void for_image_cells(secd_t *secd, image_t *img,
+                            void (*fun)(secd_t *, image_t *, cell_t *))
+{
+    cell_t *c;
+    for (c = secd->nurseryend; c < secd->fixedptr; ++c)
+        fun(secd, img, c);
+
+    cell_t *meta;
+    for (meta = secd->arrayptr; meta != secd->arrlist; meta = mcons_prev(meta)) {
+        if ((meta->flags & FLAG_ARRFREE) || !arrmeta_has_cells(meta))
+            continue;
+        for (c = meta_mem(meta); c < mcons_prev(meta); ++c)
+            fun(secd, img, c);
+    }
+}
+
+/*
+ *  Saving
+ */
+
+/* the copy of the cell to write */
+static cell_t *image_copy(secd_t *secd, image_t *img, const cell_t *c) {
+    if (c < secd->fixedptr)
+        return img->fixed + (c - secd->nurseryend);
+    return img->arrays + (c - secd->arrayptr);
+}
+
+static bool add_message(image_t *img, const char *msg) {
+    size_t len = strlen(msg) + 1;
+    if (img->msgsize + len > img->msgcap) {
+        size_t newcap = 2 * (img->msgsize + len);
+        char *newmsgs = realloc(img->msgs, newcap);
+        if (!newmsgs)
+            return false;
+        img->msgs = newmsgs;
+        img->msgcap = newcap;
+    }
+    memcpy(img->msgs + img->msgsize, msg, len);
+    img->msgsize += len;
+    return true;
+}
+
+static void save_cell(secd_t *secd, image_t *img, cell_t *c) {
+    cell_t *copy = image_copy(secd, img, c);
+    switch (cell_type(c)) {
+      case CELL_SYM: {
+        /* interned ones are numbered already */
+        const cell_t *sym = symdata(c)->cell;
+        if (sym != c) {
+            copy->as.ptr = NULL;
+            copy->as.ref = image_copy(secd, img, sym)->as.ref;
+        }
+      } break;
+      case CELL_ERROR:
+        copy->as.ptr = NULL;
+        if (!add_message(img, c->as.err.msg))
+            img->ok = false;
+        break;
+      case CELL_FUNC: {
+        int index = native_index(c);
+        if (index < 0) {
+            errorf("save-image: a native function at [%ld] is unknown\n",
+                   cell_index(secd, c));
+            img->ok = false;
+        }
+        copy->as.ptr = NULL;
+        copy->as.num = index;
+      } break;
+      case CELL_PORT:
+        if (is_fileport(c)) {
+            int index = std_index(c->as.port.as.file);
+            copy->as.ptr = NULL;
+            copy->as.num = index;
+            if (!index)
+                copy->flags &= ~(FLAG_PORTIN | FLAG_PORTOUT);
+        }
+        break;
+      default: break;
+    }
+}
+
+cell_t *secd_save_image(secd_t *secd, const char *path) {
+    assert(!secd->image, "save-image: an image is being saved already");
+
+    FILE *f = fopen(path, "wb");
+    assert(f, "save-image: %s: %s", path, strerror(errno));
+
+    secd->image = f;
+    secd->postop = SECDPOST_IMAGE;
+    return secd->truth_value;
+}
+
+static bool write_refs(FILE *f, cell_t **cells, size_t n) {
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        cellref_t ref = cell_ref(cells[i]);
+        if (fwrite(&ref, sizeof(ref), 1, f) != 1)
+            return false;
+    }
+    return true;
+}
+
+static bool write_image(secd_t *secd, FILE *f) {
+    size_t nfixed = secd->fixedptr - secd->nurseryend;
+    size_t narrays = secd->end - secd->arrayptr;
+
+    image_t img = { .ok = true };
+    img.fixed = malloc(nfixed * sizeof(cell_t));
+    img.arrays = malloc(narrays * sizeof(cell_t));
+    if ((nfixed && !img.fixed) || !img.arrays) {
+        free(img.fixed); free(img.arrays);
+        errorf("save-image: no memory\n");
+        return false;
+    }
+    memcpy(img.fixed, secd->nurseryend, nfixed * sizeof(cell_t));
+    memcpy(img.arrays, secd->arrayptr, narrays * sizeof(cell_t));
+
+    /* interned symbols are numbered in the order of secd->symtab */
+    size_t i, nsyms = 0;
+    for (i = 0; i < secd->symtab_size; ++i) {
+        if (!secd->symtab[i]) continue;
+        cell_t *sym = secd->symtab[i]->cell;
+        cell_t *copy = image_copy(secd, &img, sym);
+        copy->as.ptr = NULL;
+        copy->as.ref = nsyms++;
+    }
+    for_image_cells(secd, &img, save_cell);
+
+    image_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.cellsize = sizeof(cell_t);
+    hdr.nnatives = native_count();
+
+    hdr.heapsize = secd->end - secd->begin;
+    hdr.nursery = secd->nurseryend - secd->begin;
+    hdr.fixedptr = secd->fixedptr - secd->begin;
+    hdr.fixedlimit = secd->fixedlimit - secd->begin;
+    hdr.arraylimit = secd->arraylimit - secd->begin;
+    hdr.arrayptr = secd->arrayptr - secd->begin;
+
+    hdr.env = cell_ref(secd->env);
+    hdr.control = cell_ref(secd->control);
+    if (not_nil(secd->control))
+        hdr.ipoffset = secd->ip - code_instrs(secd->control);
+    hdr.free = cell_ref(secd->free);
+    hdr.global_env = cell_ref(secd->global_env);
+    for (i = 0; i < ARR_CLASSES; ++i)
+        hdr.arrfree[i] = cell_ref(secd->arrfree[i]);
+    hdr.arrfree_map = secd->arrfree_map;
+    hdr.input_port = cell_ref(secd->input_port);
+    hdr.output_port = cell_ref(secd->output_port);
+    hdr.debug_port = cell_ref(secd->debug_port);
+    hdr.default_io = cell_ref(secd->default_io);
+    for (i = 0; i <= CELL_ERROR; ++i)
+        hdr.type_syms[i] = cell_ref(secd->type_syms[i]);
+    hdr.truth_value = cell_ref(secd->truth_value);
+    hdr.false_value = cell_ref(secd->false_value);
+    hdr.io_frames = secd->io_frames;
+    hdr.free_cells = secd->free_cells;
+    hdr.tick = secd->tick;
+    hdr.envcounter = secd->envcounter;
+    hdr.envversion = secd->envversion;
+
+    hdr.stackbase = secd->stackbase - secd->stack;
+    hdr.nstack = secd->stackptr - secd->stack;
+    hdr.ndump = secd->dumpptr - secd->dump;
+    hdr.nzct = secd->nzct;
+    hdr.nsyms = nsyms;
+    hdr.msgsize = img.msgsize;
+
+    bool ok = img.ok
+        && (fwrite(&hdr, sizeof(hdr), 1, f) == 1)
+        && (fwrite(img.fixed, sizeof(cell_t), nfixed, f) == nfixed)
+        && (fwrite(img.arrays, sizeof(cell_t), narrays, f) == narrays)
+        && write_refs(f, secd->stack, hdr.nstack);
+    free(img.fixed); free(img.arrays);
+
+    callframe_t *frame;
+    for (frame = secd->dump; ok && (frame < secd->dumpptr); ++frame) {
+        image_frame_t out = {
+            .control = cell_ref(frame->control),
+            .env = cell_ref(frame->env),
+            .input_port = cell_ref(frame->input_port),
+            .output_port = cell_ref(frame->output_port),
+            .ipoffset = frame->ipoffset,
+            .stackbase = frame->stackbase,
+        };
+        ok = (fwrite(&out, sizeof(out), 1, f) == 1);
+    }
+
+    ok = ok && write_refs(f, secd->zct, secd->nzct);
+    for (i = 0; ok && (i < secd->symtab_size); ++i) {
+        if (!secd->symtab[i]) continue;
+        cell_t *sym = secd->symtab[i]->cell;
+        cellref_t ref = cell_ref(sym);
+        uint32_t len = strlen(symname(sym));
+        ok = (fwrite(&ref, sizeof(ref), 1, f) == 1)
+          && (fwrite(&len, sizeof(len), 1, f) == 1)
+          && (fwrite(symname(sym), 1, len, f) == len);
+    }
+    ok = ok && (fwrite(img.msgs, 1, img.msgsize, f) == img.msgsize);
+    free(img.msgs);
+    return ok;
+}
+
+bool secd_write_image(secd_t *secd) {
+    FILE *f = secd->image;
+    secd->image = NULL;
+    if (!f)
+        return false;
+
+    bool ok = write_image(secd, f);
+    if (fclose(f))
+        ok = false;
+    if (!ok)
+        errorf(";; save-image: failed to write the image\n");
+    return ok;
+}
+
+bool secd_save_start_image(secd_t *secd, cell_t *ctrl, const char *path) {
+    if (is_error(start_secd(secd, ctrl))
+        || is_error(secd_save_image(secd, path)))
+        return false;
+
+    /* what SECDPOST_IMAGE does between instructions */
+    secd->postop = SECD_NOPOST;
+    secd_mark_and_sweep_gc(secd);
+    return secd_write_image(secd);
+}
+
+/*
+ *  Loading
+ */
+
+static void load_cell(secd_t __unused *secd, image_t *img, cell_t *c) {
+    switch (cell_type(c)) {
+      case CELL_SYM:
+        c->as.sym.data = img->names[c->as.ref];
+        break;
+      case CELL_ERROR: {
+        const char *msg = img->msgs + img->msgpos;
+        img->msgpos += strlen(msg) + 1;
+        c->as.err.msg = strdup(msg);
+      } break;
+      case CELL_FUNC:
+        c->as.ptr = native_functions[c->as.num].val->as.ptr;
+        break;
+      case CELL_PORT:
+        if (is_fileport(c))
+            c->as.port.as.file = std_file(c->as.num);
+        break;
+      default: break;
+    }
+}
+
+static bool read_refs(FILE *f, cell_t **cells, size_t n) {
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        cellref_t ref;
+        if (fread(&ref, sizeof(ref), 1, f) != 1)
+            return false;
+        cells[i] = ref_cell(ref);
+    }
+    return true;
+}
+
+/* the registers, the stack, the dump and the table of zero counts */
+static bool load_registers(secd_t *secd, const image_header_t *hdr, FILE *f) {
+    size_t i;
+    secd->env = ref_cell(hdr->env);
+    secd->control = ref_cell(hdr->control);
+    if (not_nil(secd->control))
+        secd->ip = code_instrs(secd->control) + hdr->ipoffset;
+    secd->free = ref_cell(hdr->free);
+    secd->global_env = ref_cell(hdr->global_env);
+    for (i = 0; i < ARR_CLASSES; ++i)
+        secd->arrfree[i] = ref_cell(hdr->arrfree[i]);
+    secd->arrfree_map = hdr->arrfree_map;
+    secd->input_port = ref_cell(hdr->input_port);
+    secd->output_port = ref_cell(hdr->output_port);
+    secd->debug_port = ref_cell(hdr->debug_port);
+    secd->default_io = ref_cell(hdr->default_io);
+    for (i = 0; i <= CELL_ERROR; ++i)
+        secd->type_syms[i] = ref_cell(hdr->type_syms[i]);
+    secd->truth_value = ref_cell(hdr->truth_value);
+    secd->false_value = ref_cell(hdr->false_value);
+    secd->io_frames = hdr->io_frames;
+    secd->free_cells = hdr->free_cells;
+    secd->tick = hdr->tick;
+    secd->envcounter = hdr->envcounter;
+    secd->envversion = hdr->envversion;
+
+    while ((size_t)(secd->stacklimit - secd->stack) < hdr->nstack)
+        if (is_error(grow_stack(secd)))
+            return false;
+    if (!read_refs(f, secd->stack, hdr->nstack))
+        return false;
+    secd->stackbase = secd->stack + hdr->stackbase;
+    secd->stackptr = secd->stack + hdr->nstack;
+
+    while ((size_t)(secd->dumplimit - secd->dump) < hdr->ndump)
+        if (is_error(grow_dump(secd)))
+            return false;
+    for (i = 0; i < hdr->ndump; ++i) {
+        image_frame_t in;
+        if (fread(&in, sizeof(in), 1, f) != 1)
+            return false;
+        callframe_t *frame = secd->dump + i;
+        frame->control = ref_cell(in.control);
+        frame->env = ref_cell(in.env);
+        frame->input_port = ref_cell(in.input_port);
+        frame->output_port = ref_cell(in.output_port);
+        frame->ipoffset = in.ipoffset;
+        frame->stackbase = in.stackbase;
+    }
+    secd->dumpptr = secd->dump + hdr->ndump;
+
+    for (i = 0; i < hdr->nzct; ++i) {
+        cellref_t ref;
+        if (fread(&ref, sizeof(ref), 1, f) != 1)
+            return false;
+        defer_free(secd, ref_cell(ref));
+    }
+    return true;
+}
+
+static bool load_symbols(secd_t *secd, image_t *img, size_t nsyms, FILE *f) {
+    img->names = malloc(nsyms * sizeof(const char *));
+    if (nsyms && !img->names)
+        return false;
+
+    char *name = NULL;
+    size_t i, namecap = 0;
+    for (i = 0; i < nsyms; ++i) {
+        cellref_t ref;
+        uint32_t len;
+        if ((fread(&ref, sizeof(ref), 1, f) != 1)
+            || (fread(&len, sizeof(len), 1, f) != 1))
+            break;
+        if (len + 1 > namecap) {
+            namecap = 2 * (len + 1);
+            char *newname = realloc(name, namecap);
+            if (!newname) break;
+            name = newname;
+        }
+        if (fread(name, 1, len, f) != len)
+            break;
+        name[len] = '\0';
+
+        cell_t *sym = intern_symbol_at(secd, ref_cell(ref), name);
+        if (is_error(sym))
+            break;
+        img->names[i] = sym->as.sym.data;
+        /* load_cell() sets the names of all symbols */
+        sym->as.ptr = NULL;
+        sym->as.ref = i;
+    }
+    free(name);
+    return (i == nsyms);
+}
+
+static bool load_image(secd_t *secd, FILE *f, const char *path) {
+    image_header_t hdr;
+    if ((fread(&hdr, sizeof(hdr), 1, f) != 1)
+        || memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic))
+        || (hdr.cellsize != sizeof(cell_t)) || (hdr.nnatives != native_count()))
+    {
+        errorf("%s: not an image of this machine\n", path);
+        return false;
+    }
+
+    size_t committed = (hdr.fixedlimit - hdr.nursery) + (hdr.heapsize - hdr.arraylimit);
+    if (!init_mem(secd, committed, hdr.heapsize)) {
+        errorf("%s: failed to reserve memory for the heap\n", path);
+        return false;
+    }
+    if (((size_t)(secd->end - secd->begin) != hdr.heapsize)
+        || ((size_t)(secd->nurseryend - secd->begin) != hdr.nursery)
+        || !commit_heap(secd, hdr.fixedlimit, hdr.heapsize - hdr.arraylimit))
+    {
+        errorf("%s: the heap of the image does not fit\n", path);
+        return false;
+    }
+
+    secd->fixedptr = secd->begin + hdr.fixedptr;
+    secd->arrayptr = secd->begin + hdr.arrayptr;
+    size_t nfixed = secd->fixedptr - secd->nurseryend;
+    size_t narrays = secd->end - secd->arrayptr;
+
+    image_t img = { .ok = true };
+    bool ok = (fread(secd->nurseryend, sizeof(cell_t), nfixed, f) == nfixed)
+           && (fread(secd->arrayptr, sizeof(cell_t), narrays, f) == narrays)
+           && load_registers(secd, &hdr, f)
+           && load_symbols(secd, &img, hdr.nsyms, f);
+
+    if (ok) {
+        img.msgs = malloc(hdr.msgsize + 1);
+        ok = img.msgs && (fread(img.msgs, 1, hdr.msgsize, f) == hdr.msgsize);
+    }
+    if (ok)
+        for_image_cells(secd, &img, load_cell);
+    free(img.names);
+    free(img.msgs);
+
+    if (!ok)
+        errorf("%s: the image is damaged\n", path);
+    return ok;
+}
+
+static secd_t *open_image(secd_t *secd, FILE *f, const char *path) {
+    secd->postop = SECD_NOPOST;
+    secd->image = NULL;
+    bool ok = load_image(secd, f, path);
+    fclose(f);
+    if (!ok)
+        return NULL;
+
+    init_env_names(secd);
+    secd->opstats = NULL;
+    secd->lastop = SECD_LAST;
+
+    /* (secd 'save-image) returns #f in the image */
+    if (secd->stackptr > secd->stackbase)
+        secd->stackptr[-1] = secd->false_value;
+    return secd;
+}
+
+secd_t *secd_load_image(secd_t *secd, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        errorf("%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    return open_image(secd, f, path);
+}
+
+/*
+ *  Builtin images
+ *  `ld -r -b binary` makes _binary_<file>_start/_end for a file;
+ *  the symbols are weak: the bootstrapping machine has no images
+ */
+#define BUILTIN_IMAGE(name) \
+    extern const char _binary_ ## name ## _img_start[] __attribute__((weak)); \
+    extern const char _binary_ ## name ## _img_end[] __attribute__((weak));
+
+BUILTIN_IMAGE(scm2secd)
+BUILTIN_IMAGE(repl)
+
+#define BUILTIN_ENTRY(name) \
+    { #name, _binary_ ## name ## _img_start, _binary_ ## name ## _img_end }
+
+static const struct {
+    const char *name;
+    const char *start;
+    const char *end;
+} builtin_images[] = {
+    BUILTIN_ENTRY(scm2secd),
+    BUILTIN_ENTRY(repl),
+};
+
+secd_t *secd_load_builtin(secd_t *secd, const char *name) {
+    size_t i;
+    for (i = 0; i < sizeof(builtin_images)/sizeof(builtin_images[0]); ++i) {
+        if (strcmp(builtin_images[i].name, name))
+            continue;
+
+        const char *start = builtin_images[i].start;
+        if (!start)
+            break;
+        FILE *f = fmemopen((void *)start, builtin_images[i].end - start, "rb");
+        if (!f) {
+            errorf("%s: %s\n", name, strerror(errno));
+            return NULL;
+        }
+        return open_image(secd, f, name);
+    }
+    errorf("%s: no such builtin image\n", name);
+    return NULL;
+}
@@ -4,6 +4,7 @@
 #include "memory.h"
 #include "env.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 /*
@@ -14,7 +15,7 @@ index_t search_opcode_table(cell_t *sym);
 
 inline static void tail_append(secd_t *secd, cell_t **tail, cell_t *to) {
     if (is_nil(to)) return;
-    (*tail)->as.cons.cdr = share_cell(secd, to);
+    set_cdr(secd, *tail, share_cell(secd, to));
     *tail = list_next(secd, *tail);
 }
 
@@ -31,16 +32,258 @@ static void tail_append_and_move(secd_t *secd, cell_t **lst, cell_t **tail, cell
         *tail = list_next(secd, *tail);
 }
 
-cell_t *compile_control_path(secd_t *secd, cell_t *control, cell_t **fvars) {
-    assert_cell(control, "control path is invalid");
-    cell_t *compiled = SECD_NIL;
-    cell_t *freevars = SECD_NIL;
+/* a frame known at compile time */
+typedef struct scope scope_t;
+struct scope {
+    bool known;         // a frame of DUM may be unknown
+    cell_t *names;      // argument names: a list, a dot-list or a symbol
+    scope_t *up;        // NULL: the rest of environment is unknown
+};
+
+/* a path being compiled: instructions and constants */
+typedef struct {
+    instr_t *instrs;
+    size_t len;
+    size_t cap;
+
+    cell_t **consts;    // shared
+    size_t nconsts;
+    size_t constcap;
+
+    bool collect_fvars;
+    cell_t *freevars;
+    cell_t *fvcursor;
+
+    scope_t *scope;     // frames made by DUM are pushed here
+    scope_t *basescope; // the frames the path is compiled in
+} codebuf_t;
+
+/* positions of JOINs which jump to the same point */
+typedef struct {
+    size_t *pos;
+    size_t len;
+    size_t cap;
+} joinlist_t;
+
+static bool grow_buf(void **buf, size_t *cap, size_t len, size_t itemsize) {
+    if (len < *cap)
+        return true;
+    size_t newcap = (*cap ? 2 * *cap : 32);
+    void *newbuf = realloc(*buf, newcap * itemsize);
+    if (!newbuf)
+        return false;
+    *buf = newbuf;
+    *cap = newcap;
+    return true;
+}
+
+static long emit_instr(codebuf_t *buf, opindex_t op, int arg) {
+    if (!grow_buf((void **)&buf->instrs, &buf->cap, buf->len, sizeof(instr_t)))
+        return -1;
+    buf->instrs[ buf->len ] = make_instr(op, arg);
+    return buf->len++;
+}
+
+/* returns an index of the constant in the compiled vector */
+static int emit_const(secd_t *secd, codebuf_t *buf, cell_t *val) {
+    if (!grow_buf((void **)&buf->consts, &buf->constcap,
+                  buf->nconsts, sizeof(cell_t *)))
+        return -1;
+    buf->consts[ buf->nconsts ] = share_cell(secd, val);
+    return 1 + buf->nconsts++;
+}
+
+static bool add_join(joinlist_t *joins, size_t pos) {
+    if (!grow_buf((void **)&joins->pos, &joins->cap, joins->len, sizeof(size_t)))
+        return false;
+    joins->pos[ joins->len++ ] = pos;
+    return true;
+}
+
+static void patch_joins(codebuf_t *buf, joinlist_t *joins, size_t target) {
+    size_t i;
+    for (i = 0; i < joins->len; ++i) {
+        size_t pos = joins->pos[i];
+        buf->instrs[pos] = make_instr(SECD_JOIN, target - (pos + 1));
+    }
+    free(joins->pos);
+}
+
+inline static bool is_path_end(codebuf_t *buf, opindex_t op) {
+    return buf->len && (instr_op(buf->instrs[ buf->len - 1 ]) == op);
+}
+
+/*
+ *  Lexical addressing
+ */
+
+/* *stdin* and *stdout* are looked up by name at run time */
+inline static bool is_fake_variable(const char *name) {
+    return str_eq(name, SECD_FAKEVAR_STDIN) || str_eq(name, SECD_FAKEVAR_STDOUT);
+}
+
+/* returns the address of the variable or -1 if it's not known */
+static int resolve_local(const scope_t *scope, const cell_t *sym) {
+    const char *name = symname(sym);
+    if (is_fake_variable(name))
+        return -1;
+
+    int depth;
+    for (depth = 0; scope; scope = scope->up, ++depth) {
+        if (!scope->known)
+            return -1;
+
+        int index = 0;
+        const cell_t *names = scope->names;
+        while (not_nil(names) && is_cons(names)) {
+            const cell_t *cur = get_car(names);
+            if (is_symbol(cur) && sym_eq(cur, sym))
+                return make_loc(depth, index);
+            names = get_cdr(names);
+            ++index;
+        }
+        /* a dot-list or a symbol for all arguments */
+        if (is_symbol(names) && sym_eq(names, sym))
+            return make_loc(depth, index);
+    }
+    return -1;
+}
+
+/* the number of frames known at compile time */
+static int known_depth(const scope_t *scope) {
+    int depth = 0;
+    for (; scope && scope->known; scope = scope->up)
+        ++depth;
+    return depth;
+}
+
+/* empty inline cache of a global LD, see load_var() */
+static int emit_ldcache(secd_t *secd, codebuf_t *buf) {
+    cell_t *entry = new_frame(secd, SECD_NIL, SECD_NIL);
+
+    if ((emit_const(secd, buf, new_number(secd, known_depth(buf->scope))) < 0)
+        || (emit_const(secd, buf, new_number(secd, 0)) < 0)
+        || (emit_const(secd, buf, entry) < 0))
+        return -1;
+    return 0;
+}
+
+/* looks for the RAP matching a DUM at cursor;
+ * the frame of DUM gets arguments of the function RAP applies */
+static bool letrec_names(secd_t *secd, cell_t *cursor, cell_t **names) {
+    int nesting = 0;
+    cell_t *lastfunc = SECD_NIL;
+
+    while (not_nil(cursor) && is_cons(cursor)) {
+        cell_t *opcode = list_head(cursor);
+        cursor = list_next(secd, cursor);
+        if (!is_symbol(opcode))
+            return false;
+
+        index_t opind = search_opcode_table(opcode);
+        if (opind < 0)
+            return false;
+
+        switch (opind) {
+          case SECD_RAP:
+            if (nesting == 0) {
+                if (!(is_cons(lastfunc) && not_nil(lastfunc)))
+                    return false;
+                *names = get_car(lastfunc);
+                return true;
+            }
+            --nesting;
+            break;
+          case SECD_DUM:
+            ++nesting;
+            break;
+          case SECD_AP:
+            if (not_nil(cursor) && is_number(list_head(cursor)))
+                cursor = list_next(secd, cursor);
+            break;
+          default: break;
+        }
+
+        /* only the function right before RAP counts */
+        lastfunc = SECD_NIL;
+        if ((opind == SECD_LDF) && not_nil(cursor))
+            lastfunc = list_head(cursor);
+
+        int i;
+        for (i = 0; i < opcode_table[opind].args; ++i) {
+            if (is_nil(cursor))
+                return false;
+            cursor = list_next(secd, cursor);
+        }
+    }
+    return false;
+}
+
+static void pop_scope(codebuf_t *buf) {
+    scope_t *top = buf->scope;
+    buf->scope = top->up;
+    free(top);
+}
+
+static cell_t *
+compile_path(secd_t *secd, cell_t *control, cell_t **fvars, scope_t *scope);
 
+/* compiles the body of (args body . fvars) in place */
+static cell_t *compile_function(secd_t *secd, cell_t *func, scope_t *scope) {
+    if (!(is_cons(func) && not_nil(func)))
+        return SECD_NIL;
+    cell_t *body = get_cdr(func);
+    if (!(is_cons(body) && not_nil(body)))
+        return SECD_NIL;
+    if (is_control_compiled(get_car(body)))
+        return SECD_NIL;
+
+    scope_t funcscope = { .known = true, .names = get_car(func), .up = scope };
+
+    cell_t *fvars = SECD_NIL;
+    cell_t *compiled = compile_path(secd, get_car(body), &fvars, &funcscope);
+    assert_cell(compiled, "compile_function: failed");
+
+    assign_ref(secd, &body->as.cons.car, compiled);
+    assign_ref(secd, &body->as.cons.cdr, new_cons(secd, fvars, SECD_NIL));
+    write_barrier(secd, body, compiled);
+    write_barrier(secd, body, get_cdr(body));
+    return SECD_NIL;
+}
+
+static cell_t *
+compile_into(secd_t *secd, codebuf_t *buf, cell_t *control, joinlist_t *joins);
+
+/* compiles a SEL branch at the head of cursor */
+static cell_t *
+compile_branch(secd_t *secd, codebuf_t *buf, cell_t *cursor, joinlist_t *joins) {
+    assert(not_nil(cursor), "compile_control: SEL without a branch");
+    cell_t *branch = list_head(cursor);
+    assert(is_cons(branch), "compile_control: SEL branch is not a list");
+
+    scope_t *scope = buf->scope;
+    cell_t *res = compile_into(secd, buf, branch, joins);
+    while (buf->scope != scope)
+        pop_scope(buf);
+    if (is_error(res))
+        return res;
+
+    /* a branch falls through to the join point */
+    if (!(is_path_end(buf, SECD_JOIN) || is_path_end(buf, SECD_RTN)
+          || is_path_end(buf, SECD_STOP)))
+    {
+        assert(add_join(joins, buf->len), "compile_control: no memory");
+        assert(emit_instr(buf, SECD_JOIN, 0) >= 0, "compile_control: no memory");
+    }
+    return SECD_NIL;
+}
+
+static cell_t *
+compile_into(secd_t *secd, codebuf_t *buf, cell_t *control, joinlist_t *joins) {
     cell_t *cursor = control;
-    cell_t *compcursor = compiled;
-    cell_t *fvcursor = freevars;
 
     while (not_nil(cursor)) {
+        assert(is_cons(cursor), "compile_control: not a list");
         cell_t *opcode = list_head(cursor);
         cursor = list_next(secd, cursor);
 
@@ -53,61 +296,338 @@ cell_t *compile_control_path(secd_t *secd, cell_t *control, cell_t **fvars) {
         index_t opind = search_opcode_table(opcode);
         assert(opind >= 0, "Opcode not found: %s", symname(opcode))
 
-        cell_t *new_cmd = new_op(secd, opind);
-        tail_append_and_move(secd, &compiled, &compcursor,
-                             new_cons(secd, new_cmd, SECD_NIL));
+        if (opcode_table[opind].args > 0)
+            assert(not_nil(cursor), "compile_control: %s without operands",
+                                    opcode_table[opind].name);
 
-        if (new_cmd->as.op == SECD_AP) {
+        int arg = 0;
+        switch (opind) {
+          case SECD_AP:
             /* look ahead for possible number of arguments after AP */
-            cell_t *next = list_head(cursor);
-            if (is_number(next)) {
-                tail_append(secd, &compcursor,
-                            new_cons(secd, next, SECD_NIL));
+            arg = AP_ARGLIST;
+            if (not_nil(cursor) && is_number(list_head(cursor))) {
+                arg = numval(list_head(cursor));
                 cursor = list_next(secd, cursor);
             }
-        }
+            break;
+
+          case SECD_LDLDADD: case SECD_LDLOC: case SECD_TYPEP:
+            return new_error(secd, "compile_control: %s is made by the compiler only",
+                                   opcode_table[opind].name);
+
+          case SECD_DUM: {
+            scope_t *frame = malloc(sizeof(scope_t));
+            assert(frame, "compile_control: no memory");
+            frame->names = SECD_NIL;
+            frame->known = letrec_names(secd, cursor, &frame->names);
+            frame->up = buf->scope;
+            buf->scope = frame;
+          } break;
+
+          case SECD_RAP:
+            if (buf->scope != buf->basescope)
+                pop_scope(buf);
+            break;
+
+
+          case SECD_JOIN:
+            assert(joins, "compile_control: JOIN outside of SEL branches");
+            assert(add_join(joins, buf->len), "compile_control: no memory");
+            break;
+
+          case SECD_SEL: {
+            long sel = emit_instr(buf, SECD_SEL, 0);
+            assert(sel >= 0, "compile_control: no memory");
+
+            joinlist_t branchjoins = { .pos = NULL, .len = 0, .cap = 0 };
+            cell_t *res = compile_branch(secd, buf, cursor, &branchjoins);
+            if (!is_error(res)) {
+                cursor = list_next(secd, cursor);
+                /* SEL jumps over the then-branch on false */
+                buf->instrs[sel] = make_instr(SECD_SEL, buf->len - (sel + 1));
+                res = compile_branch(secd, buf, cursor, &branchjoins);
+            }
+            if (is_error(res)) {
+                free(branchjoins.pos);
+                return res;
+            }
+            cursor = list_next(secd, cursor);
+            patch_joins(buf, &branchjoins, buf->len);
+          } continue;
+
+          case SECD_LD: {
+            cell_t *var = list_head(cursor);
+            cursor = list_next(secd, cursor);
+
+            int loc = -1;
+            if (is_cons(var) && not_nil(var)) {
+                /* LD (depth . index) */
+                cell_t *depth = get_car(var);
+                cell_t *index = get_cdr(var);
+                assert(is_number(depth) && is_number(index),
+                       "compile_ctrl: LD (depth . index) expected");
+                loc = make_loc(numval(depth), numval(index));
+                assert(loc >= 0, "compile_ctrl: LD (%d . %d) is too far",
+                                 numval(depth), numval(index));
+            } else {
+                assert(is_symbol(var), "compile_ctrl: not a symbol after LD");
+                if (buf->collect_fvars)
+                    tail_append_and_move(secd, &buf->freevars, &buf->fvcursor,
+                                         new_cons(secd, var, SECD_NIL));
+                loc = resolve_local(buf->scope, var);
+            }
 
-        if (opcode_table[opind].args > 0) {
-            switch (new_cmd->as.op) {
-                case SECD_SEL: {
-                    cell_t *newfv;
-                    cell_t *thenb = compile_control_path(secd, list_head(cursor),
-                                                         (fvars ? &newfv : NULL));
-                    if (fvars)
-                        tail_append_and_move(secd, &freevars, &fvcursor, newfv);
-                    tail_append(secd, &compcursor, new_cons(secd, thenb, SECD_NIL));
-                    cursor = list_next(secd, cursor);
-
-                    cell_t *elseb = compile_control_path(secd, list_head(cursor),
-                                                         (fvars ? &newfv : NULL));
-                    if (fvars)
-                        tail_append_and_move(secd, &freevars, &fvcursor, newfv);
-                    tail_append(secd, &compcursor, new_cons(secd, elseb, SECD_NIL));
-                    cursor = list_next(secd, cursor);
-                } break;
-
-              case SECD_LD:
-                assert(is_symbol(list_head(cursor)),
-                       "compile_ctrl: not a symbol after LD");
-                if (fvars)
-                    tail_append_and_move(secd, &freevars, &fvcursor,
-                                new_cons(secd, list_head(cursor), SECD_NIL));
-                // fall through
-
-              default:
-                tail_append(secd, &compcursor,
-                            new_cons(secd, list_head(cursor), SECD_NIL));
+            if (loc >= 0) {
+                opind = SECD_LDLOC;
+                arg = loc;
+            } else {
+                /* a global variable is looked up by name */
+                arg = emit_const(secd, buf, var);
+                assert(arg >= 0, "compile_control: no memory");
+                assert(emit_ldcache(secd, buf) >= 0, "compile_control: no memory");
+            }
+          } break;
+
+          case SECD_LDF: {
+            /* the function RAP applies runs in place of the frame of DUM */
+            scope_t *scope = buf->scope;
+            cell_t *next = list_next(secd, cursor);
+            if (scope && not_nil(next) && is_symbol(list_head(next))
+                && (search_opcode_table(list_head(next)) == SECD_RAP))
+                scope = scope->up;
+
+            cell_t *res = compile_function(secd, list_head(cursor), scope);
+            if (is_error(res))
+                return res;
+          } // fall through
+
+          default:
+            if (opcode_table[opind].args > 0) {
+                arg = emit_const(secd, buf, list_head(cursor));
+                assert(arg >= 0, "compile_control: no memory");
                 cursor = list_next(secd, cursor);
             }
         }
+
+        assert(emit_instr(buf, opind, arg) >= 0, "compile_control: no memory");
+    }
+    return SECD_NIL;
+}
+
+cell_t *new_code(secd_t *secd, const instr_t *instrs, size_t len,
+                 cell_t **consts, size_t nconsts)
+{
+    cell_t *code = new_array(secd, 1 + nconsts);
+    assert_cell(code, "new_code: failed to allocate");
+
+    size_t instrsize = len * sizeof(instr_t);
+    cell_t *bytes = new_bytevector_of_size(secd, instrsize);
+    if (is_error(bytes)) {
+        free_cell(secd, code);
+        return bytes;
+    }
+    memcpy(strmem(bytes), instrs, instrsize);
+    secd->used_control += len;
+    init_with_copy(secd, arr_ref(code, 0), bytes);
+    free_cell(secd, bytes);
+
+    size_t i;
+    for (i = 0; i < nconsts; ++i) {
+        cell_t *ref = arr_ref(code, 1 + i);
+        ref->type = CELL_REF;
+        ref->nref = 0;
+        ref->as.ref = cell_ref(share_cell(secd, consts[i]));
+        remember_item(secd, code, ref);
+    }
+    return code;
+}
+
+/*
+ *  Peephole pass: fuses frequent sequences into superinstructions
+ */
+
+/* the type named by the constant of LDC, -1 if none */
+inline static int const_type(codebuf_t *buf, instr_t instr) {
+    const cell_t *c = buf->consts[ instr_arg(instr) - 1 ];
+    return is_symbol(c) ? secd_type_by_name(symname(c)) : -1;
+}
+
+/* fuses instructions in [pos, end) if possible into one or two
+ * instructions at fused, stores their count to *nfused;
+ * returns the number of instructions consumed */
+static int fuse_instrs(codebuf_t *buf, size_t pos, size_t end,
+                       instr_t *fused, int *nfused)
+{
+    const instr_t *in = buf->instrs + pos;
+    opindex_t op1 = (pos + 1 < end ? instr_op(in[1]) : SECD_LAST);
+    opindex_t op2 = (pos + 2 < end ? instr_op(in[2]) : SECD_LAST);
+    opindex_t op3 = (pos + 3 < end ? instr_op(in[3]) : SECD_LAST);
+    int type;
+
+    *nfused = 1;
+    switch (instr_op(in[0])) {
+      case SECD_CDR:
+        if (op1 == SECD_CDR && op2 == SECD_CAR) {
+            *fused = make_instr(SECD_CADDR, 0);
+            return 3;
+        }
+        if (op1 == SECD_CAR) {
+            *fused = make_instr(SECD_CADR, 0);
+            return 2;
+        }
+        break;
+
+      case SECD_CONS:
+        /* `begin` scaffold: the value of the last expression */
+        if (op1 == SECD_CAR) {
+            *fused = make_instr(SECD_CONSCAR, 0);
+            return 2;
+        }
+        break;
+
+      case SECD_TYPE:
+        /* pair? */
+        if (op1 == SECD_LDC && op2 == SECD_EQ
+            && (type = const_type(buf, in[1])) >= 0)
+        {
+            *fused = make_instr(SECD_TYPEP, type);
+            return 3;
+        }
+        break;
+
+      case SECD_LDC:
+        /* (eq? (secd-type x) 'int), EQ does not care about the order */
+        if ((op1 == SECD_LD || op1 == SECD_LDLOC)
+            && op2 == SECD_TYPE && op3 == SECD_EQ
+            && (type = const_type(buf, in[0])) >= 0)
+        {
+            fused[0] = in[1];
+            fused[1] = make_instr(SECD_TYPEP, type);
+            *nfused = 2;
+            return 4;
+        }
+        break;
+
+      case SECD_LDLOC:
+        if (op1 == SECD_LDLOC && op2 == SECD_ADD) {
+            int first = make_shortloc(instr_arg(in[0]));
+            int second = make_shortloc(instr_arg(in[1]));
+            if ((first < 0) || (second < 0))
+                break;
+            *fused = make_instr(SECD_LDLDADD, first | (second << INSTR_HALFBITS));
+            return 3;
+        }
+        break;
+
+      default: break;
+    }
+    *fused = in[0];
+    return 1;
+}
+
+#define MAX_FUSED   4
+
+inline static bool is_jump(instr_t instr) {
+    opindex_t op = instr_op(instr);
+    return (op == SECD_SEL) || (op == SECD_JOIN);
+}
+
+static void fuse_control_path(codebuf_t *buf) {
+    size_t len = buf->len;
+    instr_t *out = malloc(len * sizeof(instr_t));
+    size_t *newpos = malloc((len + 1) * sizeof(size_t));
+    bool *target = calloc(len + 1, sizeof(bool));
+    if (!(out && newpos && target))
+        goto cleanup;   // the path is valid without fusing anyway
+
+    /* a jump target can't be in the middle of a superinstruction */
+    size_t i;
+    for (i = 0; i < len; ++i)
+        if (is_jump(buf->instrs[i]))
+            target[ i + 1 + instr_arg(buf->instrs[i]) ] = true;
+
+    size_t outlen = 0;
+    i = 0;
+    while (i < len) {
+        size_t end = i + 1;
+        while (end < len && end < i + MAX_FUSED && !target[end])
+            ++end;
+
+        int nfused;
+        int used = fuse_instrs(buf, i, end, &out[outlen], &nfused);
+        while (used-- > 0)
+            newpos[i++] = outlen;
+        outlen += nfused;
+    }
+    newpos[len] = outlen;
+
+    /* relocating jumps */
+    for (i = 0; i < len; ++i) {
+        instr_t instr = buf->instrs[i];
+        if (!is_jump(instr))
+            continue;
+        size_t from = newpos[i] + 1;
+        size_t to = newpos[ i + 1 + instr_arg(instr) ];
+        out[ newpos[i] ] = make_instr(instr_op(instr), to - from);
+    }
+
+    free(buf->instrs);
+    buf->instrs = out;
+    buf->len = outlen;
+    buf->cap = len;
+    out = NULL;
+cleanup:
+    free(out);
+    free(newpos);
+    free(target);
+}
+
+static cell_t *
+compile_path(secd_t *secd, cell_t *control, cell_t **fvars, scope_t *scope) {
+    assert_cell(control, "control path is invalid");
+
+    codebuf_t buf;
+    memset(&buf, 0, sizeof(codebuf_t));
+    buf.collect_fvars = (fvars != NULL);
+    buf.scope = buf.basescope = scope;
+
+    cell_t *compiled = compile_into(secd, &buf, control, NULL);
+    while (buf.scope != buf.basescope)
+        pop_scope(&buf);
+
+    if (!is_error(compiled)) {
+        /* a path always ends with a command that leaves it */
+        if (!(is_path_end(&buf, SECD_RTN) || is_path_end(&buf, SECD_STOP)))
+            emit_instr(&buf, SECD_STOP, 0);
+
+        fuse_control_path(&buf);
+        compiled = new_code(secd, buf.instrs, buf.len, buf.consts, buf.nconsts);
+    }
+
+    size_t i;
+    for (i = 0; i < buf.nconsts; ++i)
+        drop_cell(secd, buf.consts[i]);
+    free(buf.consts);
+    free(buf.instrs);
+
+    if (is_error(compiled)) {
+        if (not_nil(buf.freevars))
+            free_cell(secd, buf.freevars);
+        return compiled;
     }
     if (fvars)
-        *fvars = freevars;
+        *fvars = buf.freevars;
     return compiled;
 }
 
+cell_t *compile_control_path(secd_t *secd, cell_t *control, cell_t **fvars) {
+    return compile_path(secd, control, fvars, NULL);
+}
+
 bool is_control_compiled(cell_t *control) {
-    return cell_type(list_head(control)) == CELL_OP;
+    if (cell_type(control) != CELL_ARRAY)
+        return false;
+    return cell_type(arr_val(control, 0)) == CELL_BYTES;
 }
 
 cell_t* compiled_ctrl(secd_t *secd, cell_t *ctrl, cell_t **fvars) {
@@ -136,65 +656,185 @@ bool compile_ctrl(secd_t *secd, cell_t **ctrl, cell_t **fvars) {
  *  SECD built-ins
  */
 
-cell_t *secd_cons(secd_t *secd) {
+#if (THREADED_CODE)
+/* opcode bodies are inlined into run_threaded() */
+# define opcode_body  inline static __attribute__((always_inline))
+#else
+# define opcode_body  static
+#endif
+
+/* the operand of the current instruction */
+inline static int op_arg(secd_t *secd) {
+    return instr_arg(secd->ip[-1]);
+}
+inline static cell_t *op_const(secd_t *secd) {
+    return code_const(secd->control, op_arg(secd));
+}
+
+opcode_body cell_t *secd_cons(secd_t *secd) {
     ctrldebugf("CONS\n");
     cell_t *a = pop_stack(secd);
 
     cell_t *b = pop_stack(secd);
 
     cell_t *cons = new_cons(secd, a, b);
-    drop_cell(secd, a); drop_cell(secd, b);
-
+    assert_cell(cons, "secd_cons: no memory for a pair");
     return push_stack(secd, cons);
 }
 
-cell_t *secd_car(secd_t *secd) {
+opcode_body cell_t *secd_car(secd_t *secd) {
     ctrldebugf("CAR\n");
     cell_t *cons = pop_stack(secd);
     assert_cell(cons, "secd_car: pop_stack() failed");
     assert(not_nil(cons), "secd_car: cons is NIL");
 
-    cell_t *car = push_stack(secd, secd_first(secd, cons));
-    drop_cell(secd, cons);
-    return car;
+    return push_stack(secd, secd_first(secd, cons));
 }
 
-cell_t *secd_cdr(secd_t *secd) {
+opcode_body cell_t *secd_cdr(secd_t *secd) {
     ctrldebugf("CDR\n");
     cell_t *cons = pop_stack(secd);
     assert(not_nil(cons), "secd_cdr: cons is NIL");
     assert_cell(cons, "secd_cdr: pop_stack() failed");
 
-    cell_t *cdr = push_stack(secd, secd_rest(secd, cons));
-    drop_cell(secd, cons);
-    return cdr;
+    return push_stack(secd, secd_rest(secd, cons));
 }
 
-cell_t *secd_ldc(secd_t *secd) {
-    ctrldebugf("LDC\n");
+/* CDRs n times and then CARs, not pushing intermediate values */
+opcode_body cell_t *cdrs_car(secd_t *secd, int n) {
+    cell_t *cons = pop_stack(secd);
+    assert_cell(cons, "secd_cadr: pop_stack() failed");
+
+    while (n-- > 0) {
+        assert(not_nil(cons), "secd_cdr: cons is NIL");
+        cons = secd_rest(secd, cons);
+        assert_cell(cons, "secd_cadr: secd_rest() failed");
+    }
+    assert(not_nil(cons), "secd_car: cons is NIL");
+
+    return push_stack(secd, secd_first(secd, cons));
+}
+
+opcode_body cell_t *secd_cadr(secd_t *secd) {
+    ctrldebugf("CADR\n");
+    return cdrs_car(secd, 1);
+}
+
+opcode_body cell_t *secd_caddr(secd_t *secd) {
+    ctrldebugf("CADDR\n");
+    return cdrs_car(secd, 2);
+}
+
+opcode_body cell_t *secd_conscar(secd_t *secd) {
+    ctrldebugf("CONSCAR\n");
+    cell_t *a = pop_stack(secd);
+    assert_cell(a, "secd_conscar: pop_stack(a) failed");
+
+    cell_t *b = pop_stack(secd);
+    assert_cell(b, "secd_conscar: pop_stack(b) failed");
 
-    cell_t *arg = pop_control(secd);
-    assert_cell(arg, "secd_ldc: pop_control failed");
+    return push_stack(secd, a);
+}
 
+opcode_body cell_t *secd_ldc(secd_t *secd) {
+    ctrldebugf("LDC\n");
+
+    cell_t *arg = op_const(secd);
     push_stack(secd, arg);
-    drop_cell(secd, arg);
     return arg;
 }
 
-cell_t *secd_ld(secd_t *secd) {
+/* looks up the variable named by the constant at index;
+ * the binding is cached until the environment below the known
+ * frames changes or anything is bound anywhere */
+inline static cell_t *load_var(secd_t *secd, int index) {
+    cell_t *control = secd->control;
+    cell_t *arg = code_const(control, index);
+    assert(is_symbol(arg), "secd_ld: not a symbol [%ld]", cell_index(secd, arg));
+
+    int version = numval(code_const(control, index + LDCACHE_VERSION));
+    cell_t *entry = code_const(control, index + LDCACHE_ENTRY);
+
+    cell_t *env = secd->env;
+    int depth = numval(code_const(control, index + LDCACHE_DEPTH));
+    while (depth-- > 0 && not_nil(env))
+        env = get_cdr(env);
+
+    if ((version == secd->envversion) && (get_car(entry) == env))
+        return get_car(get_cdr(entry));
+
+    cell_t *binding = SECD_NIL;
+    cell_t *val = lookup_binding(secd, arg, &binding);
+    assert_cellf(val, "lookup failed for %s", symname(arg));
+
+    if (not_nil(binding)) {
+        assign_ref(secd, &entry->as.cons.car, env);
+        assign_ref(secd, &entry->as.cons.cdr, binding);
+        write_barrier(secd, entry, env);
+        write_barrier(secd, entry, binding);
+        cell_t *ver = arr_ref(control, index + LDCACHE_VERSION);
+        assign_ref(secd, &ver->as.ref, new_number(secd, secd->envversion));
+        remember_item(secd, control, ver);
+    }
+    return val;
+}
+
+opcode_body cell_t *secd_ld(secd_t *secd) {
     ctrldebugf("LD\n");
 
-    cell_t *arg = pop_control(secd);
-    assert_cell(arg, "secd_ld: stack empty");
-    assert(is_symbol(arg), "secd_ld: not a symbol [%ld]", cell_index(secd, arg));
+    cell_t *val = load_var(secd, op_arg(secd));
+    if (is_error(val))
+        return val;
+    return push_stack(secd, val);
+}
+
+/* the value at the address in the environment */
+inline static cell_t *load_local(secd_t *secd, int loc) {
+    cell_t *env = secd->env;
+    int depth = loc_depth(loc);
+    while (depth-- > 0) {
+        env = get_cdr(env);
+        assert(not_nil(env), "secd_ld: no frame at depth %d", loc_depth(loc));
+    }
+
+    cell_t *frame = get_car(env);
+    assert(not_nil(frame), "secd_ld: a letrec variable is used before definition");
+
+    cell_t *vals = get_cdr(frame);
+    int index = loc_index(loc);
+    while (index-- > 0) {
+        assert(not_nil(vals), "secd_ld: no value at index %d", loc_index(loc));
+        vals = get_cdr(vals);
+    }
+    assert(not_nil(vals), "secd_ld: no value at index %d", loc_index(loc));
+    return get_car(vals);
+}
 
-    const char *sym = symname(arg);
-    cell_t *val = lookup_env(secd, sym, SECD_NIL);
-    drop_cell(secd, arg);
-    assert_cellf(val, "lookup failed for %s", sym);
+opcode_body cell_t *secd_ldloc(secd_t *secd) {
+    ctrldebugf("LDLOC\n");
+
+    cell_t *val = load_local(secd, op_arg(secd));
+    if (is_error(val))
+        return val;
     return push_stack(secd, val);
 }
 
+opcode_body cell_t *secd_ldldadd(secd_t *secd) {
+    ctrldebugf("LDLDADD\n");
+    int arg = op_arg(secd);
+
+    cell_t *b = load_local(secd, shortloc_loc(instr_lo(arg)));
+    if (is_error(b))
+        return b;
+    cell_t *a = load_local(secd, shortloc_loc(instr_hi(arg)));
+    if (is_error(a))
+        return a;
+
+    assert(is_number(a), "secd_add: a is not int");
+    assert(is_number(b), "secd_add: b is not int");
+    return push_stack(secd, new_number(secd, numval(a) + numval(b)));
+}
+
 bool list_eq(secd_t *secd, const cell_t *xs, const cell_t *ys) {
     asserti(is_cons(xs), "list_eq: [%ld] is not a cons", cell_index(secd, xs));
 
@@ -250,9 +890,9 @@ bool is_equal(secd_t *secd, const cell_t *a, const cell_t *b) {
       case CELL_CONS:  return list_eq(secd, a, b);
       case CELL_ARRAY: return array_eq(secd, a, b);
       case CELL_STR:   return !strcmp(strval(a), strval(b));
-      case CELL_SYM:   return (str_eq(symname(a), symname(b)));
+      case CELL_SYM:   return sym_eq(a, b);
       case CELL_INT: case CELL_CHAR:
-                       return (a->as.num == b->as.num);
+                       return (numval(a) == numval(b));
       case CELL_OP:    return (a->as.op == b->as.op);
       case CELL_FUNC:  return (a->as.ptr == b->as.ptr);
       case CELL_BYTES: {
@@ -271,17 +911,24 @@ bool is_equal(secd_t *secd, const cell_t *a, const cell_t *b) {
     return false;
 }
 
-cell_t *secd_type(secd_t *secd) {
+opcode_body cell_t *secd_type(secd_t *secd) {
     ctrldebugf("TYPE\n");
     cell_t *val = pop_stack(secd);
     assert_cell(val, "secd_type: pop_stack() failed");
 
-    cell_t *typec = secd_type_sym(secd, val);
-    drop_cell(secd, val);
-    return push_stack(secd, typec);
+    return push_stack(secd, secd_type_sym(secd, val));
+}
+
+opcode_body cell_t *secd_typep(secd_t *secd) {
+    ctrldebugf("TYPEP\n");
+    cell_t *val = pop_stack(secd);
+    assert_cell(val, "secd_typep: pop_stack() failed");
+
+    cell_t *res = to_bool(secd, cell_type(val) == (enum cell_type)op_arg(secd));
+    return push_stack(secd, res);
 }
 
-cell_t *secd_eq(secd_t *secd) {
+opcode_body cell_t *secd_eq(secd_t *secd) {
     ctrldebugf("EQ\n");
     cell_t *a = pop_stack(secd);
     assert_cell(a, "secd_eq: pop_stack(a) failed");
@@ -289,12 +936,10 @@ cell_t *secd_eq(secd_t *secd) {
     cell_t *b = pop_stack(secd);
     assert_cell(b, "secd_eq: pop_stack(b) failed");
 
-    cell_t *val = to_bool(secd, is_equal(secd, a, b));
-    drop_cell(secd, a); drop_cell(secd, b);
-    return push_stack(secd, val);
+    return push_stack(secd, to_bool(secd, is_equal(secd, a, b)));
 }
 
-static cell_t *arithm_op(secd_t *secd, int op(int, int)) {
+opcode_body cell_t *arithm_op(secd_t *secd, int op(int, int)) {
     cell_t *a = pop_stack(secd);
     assert_cell(a, "secd_arithm: pop_stack(a) failed")
     assert(is_number(a), "secd_add: a is not int");
@@ -303,9 +948,7 @@ static cell_t *arithm_op(secd_t *secd, int op(int, int)) {
     assert_cell(b, "secd_arithm: pop_stack(b) failed");
     assert(is_number(b), "secd_add: b is not int");
 
-    int res = op(numval(a), numval(b));
-    drop_cell(secd, a); drop_cell(secd, b);
-    return push_stack(secd, new_number(secd, res));
+    return push_stack(secd, new_number(secd, op(numval(a), numval(b))));
 }
 
 inline static int iplus(int x, int y) {
@@ -324,28 +967,28 @@ inline static int irem(int x, int y) {
     return x % y;
 }
 
-cell_t *secd_add(secd_t *secd) {
+opcode_body cell_t *secd_add(secd_t *secd) {
     ctrldebugf("ADD\n");
     return arithm_op(secd, iplus);
 }
-cell_t *secd_sub(secd_t *secd) {
+opcode_body cell_t *secd_sub(secd_t *secd) {
     ctrldebugf("SUB\n");
     return arithm_op(secd, iminus);
 }
-cell_t *secd_mul(secd_t *secd) {
+opcode_body cell_t *secd_mul(secd_t *secd) {
     ctrldebugf("MUL\n");
     return arithm_op(secd, imult);
 }
-cell_t *secd_div(secd_t *secd) {
+opcode_body cell_t *secd_div(secd_t *secd) {
     ctrldebugf("DIV\n");
     return arithm_op(secd, idiv);
 }
-cell_t *secd_rem(secd_t *secd) {
+opcode_body cell_t *secd_rem(secd_t *secd) {
     ctrldebugf("REM\n");
     return arithm_op(secd, irem);
 }
 
-cell_t *secd_leq(secd_t *secd) {
+opcode_body cell_t *secd_leq(secd_t *secd) {
     ctrldebugf("LEQ\n");
 
     cell_t *opnd1 = pop_stack(secd);
@@ -356,136 +999,130 @@ cell_t *secd_leq(secd_t *secd) {
     assert(is_number(opnd2) || cell_type(opnd2) == CELL_CHAR,
             "secd_leq: int/char expected as opnd2");
 
-    cell_t *result = to_bool(secd, numval(opnd1) <= numval(opnd2));
-    drop_cell(secd, opnd1); drop_cell(secd, opnd2);
-    return push_stack(secd, result);
+    return push_stack(secd, to_bool(secd, numval(opnd1) <= numval(opnd2)));
 }
 
-cell_t *secd_sel(secd_t *secd) {
+opcode_body cell_t *secd_sel(secd_t *secd) {
     ctrldebugf("SEL\n");
 
-    cell_t *condcell = pop_stack(secd);
-    bool cond = secd_bool(secd, condcell);
-    drop_cell(secd, condcell);
+    bool cond = secd_bool(secd, pop_stack(secd));
 
-    cell_t *thenb = pop_control(secd);
-    cell_t *elseb = pop_control(secd);
-    assert(is_cons(thenb) && is_cons(elseb), "secd_sel: both branches must be conses");
-
-    cell_t *joinb = secd->control;
-    push_dump(secd, joinb);
-
-    secd->control = share_cell(secd, cond ? thenb : elseb);
-
-    drop_cell(secd, thenb); drop_cell(secd, elseb); drop_cell(secd, joinb);
+    /* the then-branch follows SEL, the else-branch is after it */
+    if (!cond)
+        secd->ip += op_arg(secd);
     return secd->control;
 }
 
-cell_t *secd_join(secd_t *secd) {
+opcode_body cell_t *secd_join(secd_t *secd) {
     ctrldebugf("JOIN\n");
 
-    cell_t *joinb = pop_dump(secd);
-    assert_cell(joinb, "secd_join: pop_dump() failed");
-
-    secd->control = joinb; //share_cell(secd, joinb); drop_cell(secd, joinb);
+    secd->ip += op_arg(secd);
     return secd->control;
 }
 
 
 
-cell_t *secd_ldf(secd_t *secd) {
+opcode_body cell_t *secd_ldf(secd_t *secd) {
     ctrldebugf("LDF\n");
 
-    cell_t *func = pop_control(secd);
-    assert_cell(func, "secd_ldf: failed to get the control path");
+    cell_t *func = op_const(secd);
+    assert(is_cons(func) && is_cons(list_next(secd, func)),
+           "secd_ldf: not a function definition");
 
-    cell_t *fvars = SECD_NIL;
-    compile_ctrl(secd, &func->as.cons.cdr->as.cons.car, &fvars);
-
-    cell_t *fvcons = new_cons(secd, fvars, SECD_NIL);
-    func->as.cons.cdr->as.cons.cdr = share_cell(secd, fvcons);
+    /* usually compiled with the path of LDF already */
+    cell_t *res = compile_function(secd, func, NULL);
+    assert_cell(res, "secd_ldf: failed to compile the function");
 
     cell_t *closure = new_cons(secd, func, secd->env);
-    drop_cell(secd, func);
+    assert_cell(closure, "secd_ldf: no memory for a closure");
     return push_stack(secd, closure);
 }
 
 #if TAILRECURSION
 /*
- * returns a new dump for a tail-recursive call
- * or SECD_NIL if no Tail Call Optimization.
+ * checks if the call is in a tail position: the instructions
+ * after ip do not touch the callee's result before RTN.
  */
-static cell_t * new_dump_if_tailrec(secd_t *secd, cell_t *control, cell_t *dump) {
-    if (is_nil(control))
-        return SECD_NIL;
+static bool is_tailcall(const instr_t *ip) {
+    while (true) {
+        switch (instr_op(*ip)) {
+          case SECD_RTN:
+            return true;
+          case SECD_JOIN:
+            ip += 1 + instr_arg(*ip);
+            break;
+          case SECD_CONS:
+            /* a situation of CONS CAR - it is how `begin` implemented */
+            if (instr_op(ip[1]) != SECD_CAR)
+                return false;
+            ip += 2;
+            break;
+          case SECD_CONSCAR:
+            ++ip;
+            break;
+          default:
+            /* all other commands (except DUM, which must have RAP after it)
+             * mess with the stack. TCO's not possible: */
+            return false;
+        }
+    }
+}
+#endif
 
-    cell_t *nextop = list_head(control);
-    if (cell_type(nextop) != CELL_OP)
-        return SECD_NIL;
+/* saves the current S, E, C on the dump,
+ * the callee's stack starts above the caller's values */
+static cell_t *push_return(secd_t *secd, cell_t *env) {
+    callframe_t *frame = push_dump(secd);
+    assert(frame, "push_return: no memory for the dump");
 
-    opindex_t opind = nextop->as.op;
-
-    if (opind == SECD_RTN) {
-        return dump;
-    } else if (opind == SECD_JOIN) {
-        cell_t *join = list_head(dump);
-        return new_dump_if_tailrec(secd, join, list_next(secd, dump));
-    } else if (opind == SECD_CONS) {
-        /* a situation of CONS CAR - it is how `begin` implemented */
-        cell_t *nextcontrol = list_next(secd, control);
-        cell_t *afternext = list_head(nextcontrol);
-        if (cell_type(afternext) != CELL_OP)
-            return SECD_NIL;
-        if (afternext->as.op != SECD_CAR)
-            return SECD_NIL;
-        return new_dump_if_tailrec(secd, list_next(secd, nextcontrol), dump);
-    }
+    frame->control = secd->control;
+    frame->ipoffset = secd->ip - code_instrs(secd->control);
+    frame->env = env;
+    frame->stackbase = secd->stackbase - secd->stack;
+    frame->input_port = secd->input_port;
+    frame->output_port = secd->output_port;
 
-    /* all other commands (except DUM, which must have RAP after it)
-     * mess with the stack. TCO's not possible: */
+    secd->stackbase = secd->stackptr;
     return SECD_NIL;
 }
-#endif
 
 static cell_t *extract_argvals(secd_t *secd) {
-    if (!is_number(list_head(secd->control))) {
-        return pop_stack(secd); // don't forget to drop
+    int n = op_arg(secd);
+    if (n == AP_ARGLIST) {
+        return pop_stack(secd);
     }
 
-    cell_t *argvals = SECD_NIL;
-    cell_t *argvcursor = SECD_NIL;
-    cell_t *new_stack = secd->stack;
-
-    cell_t *ntop = pop_control(secd);
-    int n = numval(ntop);
     ctrldebugf(" %d args on stack\n", n);
+    assert(stack_depth(secd) >= (size_t)n, "secd_ap: not enough arguments on stack");
 
-    while (n-- > 0) {
-        argvcursor = new_stack;
-        new_stack = list_next(secd, new_stack);
-    }
-    if (not_nil(argvcursor)) {
-        argvals = secd->stack;
-        argvcursor->as.cons.cdr = SECD_NIL;
+    cell_t *argvals = SECD_NIL;
+    cell_t **val;
+    for (val = secd->stackptr - n; val < secd->stackptr; ++val) {
+        argvals = new_cons(secd, *val, argvals);
+        if (is_error(argvals))
+            return argvals;
     }
-    secd->stack = new_stack; // no share_cell
-
-    drop_cell(secd, ntop);
-    // has at least 1 "ref", don't forget to drop
+    secd->stackptr -= n;
     return argvals;
 }
 
+/* the body of a closure is compiled in place */
+static cell_t *set_closure_control(secd_t *secd, cell_t *func) {
+    cell_t *body = get_cdr(func);
+    cell_t *ctrl = get_car(body);
+    cell_t *res = set_control(secd, &ctrl);
+    set_car(secd, body, ctrl);
+    return res;
+}
+
 static cell_t *secd_ap_native(secd_t *secd, cell_t *clos, cell_t *args) {
     secd_nativefunc_t native = (secd_nativefunc_t)clos->as.ptr;
     cell_t *result = native(secd, args);
     assert_cellf(result, "secd_ap: a built-in routine failed: %s", errmsg(result));
-    push_stack(secd, result);
-
-    drop_cell(secd, clos); drop_cell(secd, args);
-    return result;
+    return push_stack(secd, result);
 }
 
-cell_t *secd_ap(secd_t *secd) {
+opcode_body cell_t *secd_ap(secd_t *secd) {
     ctrldebugf("AP\n");
 
     cell_t *closure = pop_stack(secd);
@@ -508,83 +1145,63 @@ cell_t *secd_ap(secd_t *secd) {
     assert(cell_type(list_head(newenv)) == CELL_FRAME, "secd_ap: env holds not a frame\n");
 
 #if TAILRECURSION
-    cell_t *new_dump = new_dump_if_tailrec(secd, secd->control, secd->dump);
-    if (new_dump) {
-        assign_cell(secd, &secd->dump, new_dump);
+    if (is_tailcall(secd->ip)) {
         ctrldebugf("secd_ap: tailrec\n");
-    } else {
-        push_dump(secd, secd->control);
-        push_dump(secd, secd->env);
-        push_dump(secd, secd->stack);
-    }
-#else
-    push_dump(secd, secd->control);
-    push_dump(secd, secd->env);
-    push_dump(secd, secd->stack);
+        clear_stack(secd);
+    } else
 #endif
-
-    drop_cell(secd, secd->stack);
-    secd->stack = SECD_NIL;
+    {
+        cell_t *ret = push_return(secd, secd->env);
+        assert_cell(ret, "secd_ap: failed to save the caller");
+    }
 
     cell_t *argnames = get_car(func);
     cell_t *frame = setup_frame(secd, argnames, argvals, newenv);
     assert_cell(frame, "secd_ap: setup_frame() failed");
 
-    memdebugf("secd_ap: dropping env[%ld]\n", cell_index(secd, secd->env));
-    assign_cell(secd, &secd->env, new_cons(secd, frame, newenv));
+    cell_t *env = new_cons(secd, frame, newenv);
+    assert_cell(env, "secd_ap: no memory for the environment");
+    secd->env = env;
     if (ENVDEBUG) print_env(secd);
 
-    set_control(secd, &func->as.cons.cdr->as.cons.car);
-
-    drop_cell(secd, closure); drop_cell(secd, argvals);
+    set_closure_control(secd, func);
     return secd->truth_value;
 }
 
-cell_t *secd_rtn(secd_t *secd) {
+opcode_body cell_t *secd_rtn(secd_t *secd) {
     ctrldebugf("RTN\n");
 
-    assert(is_nil(secd->control), "secd_rtn: commands after RTN");
-
-    assert(not_nil(secd->stack), "secd_rtn: stack is empty");
-    cell_t *result = pop_stack(secd);
-    assert(is_nil(secd->stack), "secd_rtn: stack holds more than 1 value");
-
-    cell_t *prevstack = pop_dump(secd);
-    cell_t *prevenv = pop_dump(secd);
-    cell_t *prevcontrol = pop_dump(secd);
+    assert(stack_depth(secd) > 0, "secd_rtn: stack is empty");
+    assert(stack_depth(secd) == 1, "secd_rtn: stack holds more than 1 value");
+    cell_t *result = secd->stackptr[-1];    // stays on the stack
 
-    secd->stack = share_cell(secd, new_cons(secd, result, prevstack));
-    drop_cell(secd, result); drop_cell(secd, prevstack);
+    callframe_t *frame = pop_dump(secd);
+    assert(frame, "secd_rtn: the dump is empty");
 
-    drop_cell(secd, secd->env);
-    secd->env = prevenv;
-    // share_cell(secd, prevenv); drop_cell(secd, prevenv);
+    secd->stackbase = secd->stack + frame->stackbase;
 
-    secd->control = prevcontrol;
-    // share_cell(secd, prevcontrol); drop_cell(secd, prevcontrol);
+    secd->env = frame->env;
+    secd->control = frame->control;
+    secd->ip = code_instrs(secd->control) + frame->ipoffset;
 
     /* restoring I/O */
-    cell_t *frame_io = get_car(prevenv);
-    secd->input_port = get_car(frame_io->as.frame.io);
-    secd->output_port = get_cdr(frame_io->as.frame.io);
+    secd->input_port = frame->input_port;
+    secd->output_port = frame->output_port;
 
     return result;
 }
 
 
-cell_t *secd_dum(secd_t *secd) {
+opcode_body cell_t *secd_dum(secd_t *secd) {
     ctrldebugf("DUM\n");
 
-    cell_t *oldenv = secd->env;
-    cell_t *newenv = new_cons(secd, SECD_NIL, oldenv);
-
-    secd->env = share_cell(secd, newenv);
-    drop_cell(secd, oldenv);
-
-    return newenv;
+    cell_t *env = new_cons(secd, SECD_NIL, secd->env);
+    assert_cell(env, "secd_dum: no memory for the environment");
+    secd->env = env;
+    return env;
 }
 
-cell_t *secd_rap(secd_t *secd) {
+opcode_body cell_t *secd_rap(secd_t *secd) {
     ctrldebugf("RAP\n");
 
     cell_t *closure = pop_stack(secd);
@@ -594,9 +1211,8 @@ cell_t *secd_rap(secd_t *secd) {
     cell_t *func = get_car(closure);
     cell_t *argnames = get_car(func);
 
-    push_dump(secd, secd->control);
-    push_dump(secd, get_cdr(secd->env));
-    push_dump(secd, secd->stack);
+    cell_t *ret = push_return(secd, get_cdr(secd->env));
+    assert_cell(ret, "secd_rap: failed to save the caller");
 
     cell_t *frame = setup_frame(secd, argnames, argvals, list_next(secd, newenv));
     assert_cell(frame, "secd_rap: setup_frame() failed");
@@ -606,23 +1222,16 @@ cell_t *secd_rap(secd_t *secd) {
     printf(" argnames: \n"); dbg_printc(secd, argnames);
     printf(" argvals : \n"); dbg_printc(secd, argvals);
 #endif
-    newenv->as.cons.car = share_cell(secd, frame);
-
-    drop_cell(secd, secd->stack);
-    secd->stack = SECD_NIL;
+    set_car(secd, newenv, share_cell(secd, frame));
 
-    cell_t *oldenv = secd->env;
-    secd->env = share_cell(secd, newenv);
+    secd->env = newenv;
 
-    set_control(secd, &func->as.cons.cdr->as.cons.car);
-
-    drop_cell(secd, oldenv);
-    drop_cell(secd, closure); drop_cell(secd, argvals);
+    set_closure_control(secd, func);
     return secd->truth_value;
 }
 
 
-cell_t *secd_read(secd_t *secd) {
+opcode_body cell_t *secd_read(secd_t *secd) {
     ctrldebugf("READ\n");
 
     cell_t *inp = sexp_parse(secd, SECD_NIL);
@@ -632,10 +1241,11 @@ cell_t *secd_read(secd_t *secd) {
     return inp;
 }
 
-cell_t *secd_print(secd_t *secd) {
+opcode_body cell_t *secd_print(secd_t *secd) {
     ctrldebugf("PRINT\n");
 
-    cell_t *top = get_car(secd->stack);
+    assert(stack_depth(secd) > 0, "secd_print: no stack");
+    cell_t *top = secd->stackptr[-1];
     assert_cell(top, "secd_print: no stack");
 
     sexp_print(secd, top);
@@ -672,9 +1282,12 @@ const opcode_t opcode_table[] = {
     // keep symbols sorted properly
     [SECD_ADD]  = { "ADD",     secd_add,  0, -1},
     [SECD_AP]   = { "AP",      secd_ap,   0, -1},
+    [SECD_CADDR]= { "CADDR",   secd_caddr,0,  0},
+    [SECD_CADR] = { "CADR",    secd_cadr, 0,  0},
     [SECD_CAR]  = { "CAR",     secd_car,  0,  0},
     [SECD_CDR]  = { "CDR",     secd_cdr,  0,  0},
     [SECD_CONS] = { "CONS",    secd_cons, 0, -1},
+    [SECD_CONSCAR] = { "CONSCAR", secd_conscar, 0, -1},
     [SECD_DIV]  = { "DIV",     secd_div,  0, -1},
     [SECD_DUM]  = { "DUM",     secd_dum,  0,  0},
     [SECD_EQ]   = { "EQ",      secd_eq,   0, -1},
@@ -682,6 +1295,8 @@ const opcode_t opcode_table[] = {
     [SECD_LD]   = { "LD",      secd_ld,   1,  1},
     [SECD_LDC]  = { "LDC",     secd_ldc,  1,  1},
     [SECD_LDF]  = { "LDF",     secd_ldf,  1,  1},
+    [SECD_LDLDADD] = { "LDLDADD", secd_ldldadd, 0, 1},
+    [SECD_LDLOC]= { "LDLOC",   secd_ldloc,0,  1},
     [SECD_LEQ]  = { "LEQ",     secd_leq,  0, -1},
     [SECD_MUL]  = { "MUL",     secd_mul,  0, -1},
     [SECD_PRN]  = { "PRINT",   secd_print,0,  0},
@@ -693,6 +1308,7 @@ const opcode_t opcode_table[] = {
     [SECD_STOP] = { "STOP",    SECD_NIL,  0,  0},
     [SECD_SUB]  = { "SUB",     secd_sub,  0, -1},
     [SECD_TYPE] = { "TYPE",    secd_type, 0,  0},
+    [SECD_TYPEP]= { "TYPEP",   secd_typep,0,  0},
 
     [SECD_LAST] = { NULL,         NULL,      0,  0}
 };
@@ -705,17 +1321,120 @@ inline size_t opcode_count(void) {
     return optable_len;
 }
 
-index_t search_opcode_table(cell_t *sym) {
+index_t opcode_for_name(const char *name) {
     index_t a = 0;
     index_t b = opcode_count();
 
     while (a != b) {
         index_t c = (a + b) / 2;
-        int ord = str_cmp( symname(sym), opcode_table[c].name);
+        int ord = str_cmp(name, opcode_table[c].name);
         if (ord == 0) return c;
         if (ord < 0) b = c;
-        else a = c;
+        else a = c + 1;
     }
     return -1;
 }
 
+index_t search_opcode_table(cell_t *sym) {
+    if (!is_symbol(sym) || is_immediate(sym))
+        return -1;
+    return symdata(sym)->opcode;
+}
+
+
+#if (THREADED_CODE)
+/*
+ *  Direct-threaded interpreter loop
+ */
+
+cell_t *run_threaded(secd_t *secd) {
+    static const void *const dispatch[] = {
+        [SECD_ADD]  = &&do_add,
+        [SECD_AP]   = &&do_ap,
+        [SECD_CADDR]= &&do_caddr,
+        [SECD_CADR] = &&do_cadr,
+        [SECD_CAR]  = &&do_car,
+        [SECD_CDR]  = &&do_cdr,
+        [SECD_CONS] = &&do_cons,
+        [SECD_CONSCAR] = &&do_conscar,
+        [SECD_DIV]  = &&do_div,
+        [SECD_DUM]  = &&do_dum,
+        [SECD_EQ]   = &&do_eq,
+        [SECD_JOIN] = &&do_join,
+        [SECD_LD]   = &&do_ld,
+        [SECD_LDC]  = &&do_ldc,
+        [SECD_LDF]  = &&do_ldf,
+        [SECD_LDLDADD] = &&do_ldldadd,
+        [SECD_LDLOC]= &&do_ldloc,
+        [SECD_LEQ]  = &&do_leq,
+        [SECD_MUL]  = &&do_mul,
+        [SECD_PRN]  = &&do_print,
+        [SECD_RAP]  = &&do_rap,
+        [SECD_READ] = &&do_read,
+        [SECD_REM]  = &&do_rem,
+        [SECD_RTN]  = &&do_rtn,
+        [SECD_SEL]  = &&do_sel,
+        [SECD_STOP] = &&do_stop,
+        [SECD_SUB]  = &&do_sub,
+        [SECD_TYPE] = &&do_type,
+        [SECD_TYPEP]= &&do_typep,
+    };
+
+    cell_t *ret;
+    opindex_t opind;
+
+/* every opcode body ends with its own copy of fetch-and-jump */
+#define DISPATCH                                    \
+    opind = instr_op(*secd->ip++);                  \
+    if (secd->opstats) count_opcode(secd, opind);   \
+    goto *dispatch[opind]
+
+#define NEXT                                        \
+    if (is_error(ret)) goto failed;                 \
+    if (secd->postop) secd_run_postop(secd);        \
+    ++secd->tick;                                   \
+    DISPATCH
+
+    DISPATCH;
+
+do_add:   ret = secd_add(secd);   NEXT;
+do_ap:    ret = secd_ap(secd);    NEXT;
+do_caddr: ret = secd_caddr(secd); NEXT;
+do_cadr:  ret = secd_cadr(secd);  NEXT;
+do_car:   ret = secd_car(secd);   NEXT;
+do_cdr:   ret = secd_cdr(secd);   NEXT;
+do_cons:  ret = secd_cons(secd);  NEXT;
+do_conscar: ret = secd_conscar(secd); NEXT;
+do_div:   ret = secd_div(secd);   NEXT;
+do_dum:   ret = secd_dum(secd);   NEXT;
+do_eq:    ret = secd_eq(secd);    NEXT;
+do_join:  ret = secd_join(secd);  NEXT;
+do_ld:    ret = secd_ld(secd);    NEXT;
+do_ldc:   ret = secd_ldc(secd);   NEXT;
+do_ldf:   ret = secd_ldf(secd);   NEXT;
+do_ldldadd: ret = secd_ldldadd(secd); NEXT;
+do_ldloc: ret = secd_ldloc(secd); NEXT;
+do_leq:   ret = secd_leq(secd);   NEXT;
+do_mul:   ret = secd_mul(secd);   NEXT;
+do_print: ret = secd_print(secd); NEXT;
+do_rap:   ret = secd_rap(secd);   NEXT;
+do_read:  ret = secd_read(secd);  NEXT;
+do_rem:   ret = secd_rem(secd);   NEXT;
+do_rtn:   ret = secd_rtn(secd);   NEXT;
+do_sel:   ret = secd_sel(secd);   NEXT;
+do_sub:   ret = secd_sub(secd);   NEXT;
+do_type:  ret = secd_type(secd);  NEXT;
+do_typep: ret = secd_typep(secd); NEXT;
+
+do_stop:
+    return SECD_NIL;
+
+failed:
+    errorf("run: %s failed at\n", opcode_table[ opind ].name);
+    print_env(secd);
+    return ret;
+
+#undef NEXT
+#undef DISPATCH
+}
+#endif
@@ -4,22 +4,24 @@
 #include "env.h"
 #include "secdops.h"
 
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
 /*
  * SECD machine
  */
 
-secd_t * init_secd(secd_t *secd) {
-    /* allocate memory chunk */
-    cell_t *heap = (cell_t *)calloc(N_CELLS, sizeof(cell_t));
+static void init_type_syms(secd_t *secd);
 
+secd_t * init_secd(secd_t *secd, size_t size, size_t maxsize) {
     secd->free = SECD_NIL;
-    secd->stack = secd->dump =
-        secd->control = secd->env = SECD_NIL;
+    secd->control = secd->env = SECD_NIL;
 
-    init_mem(secd, heap, N_CELLS);
+    if (!init_mem(secd, (size ? size : N_CELLS), (maxsize ? maxsize : MAX_CELLS)))
+        return NULL;
+    init_type_syms(secd);
 
     secd->truth_value = share_cell(secd, new_symbol(secd, SECD_TRUE));
     secd->false_value = share_cell(secd, new_symbol(secd, SECD_FALSE));
@@ -27,19 +29,19 @@ secd_t * init_secd(secd_t *secd) {
     secd->input_port = share_cell(secd, secd_stdin(secd));
     secd->output_port = share_cell(secd, secd_stdout(secd));
     secd->debug_port = SECD_NIL;
+    secd->image = NULL;
 
     init_env(secd);
 
     secd->tick = 0;
+    secd->opstats = NULL;
+    secd->lastop = SECD_LAST;
     return secd;
 }
 
-cell_t * run_secd(secd_t *secd, cell_t *ctrl) {
-    cell_t *op;
-
-    share_cell(secd, ctrl);
-    set_control(secd, &ctrl);
-
+#if (!THREADED_CODE)
+/* the portable loop: calls opcodes through opcode_table */
+static cell_t * run_table(secd_t *secd) {
 #if (TIMING)
     struct timeval ts_then;
     struct timeval ts_now;
@@ -49,13 +51,9 @@ cell_t * run_secd(secd_t *secd, cell_t *ctrl) {
 #if (TIMING)
         gettimeofday(&ts_then, NULL);
 #endif
-        op = pop_control(secd);
-        assert_cell(op, "run: no command");
-        assert_or_continue(
-                cell_type(op) == CELL_OP,
-                "run: not an opcode at [%ld]\n", cell_index(secd, op));
-
-        int opind = op->as.op;
+        int opind = instr_op(*secd->ip++);
+        if (secd->opstats)
+            count_opcode(secd, opind);
         secd_opfunc_t callee = (secd_opfunc_t) opcode_table[ opind ].fun;
         if (SECD_NIL == callee)
             return SECD_NIL;  // STOP
@@ -66,7 +64,6 @@ cell_t * run_secd(secd_t *secd, cell_t *ctrl) {
             print_env(secd);
             return ret;
         }
-        drop_cell(secd, op);
 
 #if TIMING
         gettimeofday(&ts_now, NULL);
@@ -74,17 +71,34 @@ cell_t * run_secd(secd_t *secd, cell_t *ctrl) {
         if (usec < 0) usec += 1000000;
         ctrldebugf("    0.%06d s elapsed\n", usec);
 #endif
-        switch (secd->postop) {
-          case SECDPOST_GC:
-              secd_mark_and_sweep_gc(secd);
-              secd->postop = SECD_NOPOST;
-              break;
-          default: break;
-        }
+        if (secd->postop)
+            secd_run_postop(secd);
 
         ++secd->tick;
     }
 }
+#endif
+
+cell_t * start_secd(secd_t *secd, cell_t *ctrl) {
+    share_cell(secd, ctrl);
+    cell_t *control = set_control(secd, &ctrl);
+    assert_cell(control, "start_secd: no control path to run");
+    return control;
+}
+
+cell_t * run_secd(secd_t *secd, cell_t *ctrl) {
+    cell_t *control = start_secd(secd, ctrl);
+    assert_cell(control, "run_secd: no control path to run");
+    return resume_secd(secd);
+}
+
+cell_t * resume_secd(secd_t *secd) {
+#if (THREADED_CODE)
+    return run_threaded(secd);
+#else
+    return run_table(secd);
+#endif
+}
 
 /*
  *  Serialization
@@ -107,13 +121,26 @@ const char * secd_type_names[] = {
     [CELL_ERROR] = "err"
 };
 
+/* symbols returned by TYPE are allocated once, secd->type_syms holds them */
+static void init_type_syms(secd_t *secd) {
+    enum cell_type t;
+    for (t = CELL_CONS; t <= CELL_ERROR; ++t)
+        secd->type_syms[t] = share_cell(secd, new_symbol(secd, secd_type_names[t]));
+}
+
 cell_t *secd_type_sym(secd_t *secd, const cell_t *cell) {
-    const char *type = "unknown";
     enum cell_type t = cell_type(cell);
     assert(t <= CELL_ERROR, "secd_type_sym: type is invalid");
-    type = secd_type_names[t];
     assert(t, "secd_type_names: unkonwn type of %d", t);
-    return new_symbol(secd, type);
+    return secd->type_syms[t];
+}
+
+int secd_type_by_name(const char *name) {
+    enum cell_type t;
+    for (t = CELL_CONS; t <= CELL_ERROR; ++t)
+        if (str_eq(name, secd_type_names[t]))
+            return t;
+    return -1;
 }
 
 static cell_t *chain_index(secd_t *secd, const cell_t *cell, cell_t *prev) {
@@ -134,10 +161,10 @@ cell_t *serialize_cell(secd_t *secd, cell_t *cell) {
             opt = chain_index(secd, get_car(cell), cdrc);
         } break;
       case CELL_PORT: {
-          if (cell->as.port.file) {
+          if (is_fileport(cell)) {
               opt = chain_sym(secd, "file", SECD_NIL);
           } else {
-              cell_t *strc = chain_index(secd, (cell_t*)strval(cell->as.port.as.str), SECD_NIL);
+              cell_t *strc = chain_index(secd, (cell_t*)strval(port_str(cell)), SECD_NIL);
               opt = chain_sym(secd, "str", strc);
           }
         } break;
@@ -156,10 +183,10 @@ cell_t *serialize_cell(secd_t *secd, cell_t *cell) {
         break;
       case CELL_ARRMETA: {
             cell_t *arr;
-            if (cell->as.mcons.cells)
+            if (arrmeta_has_cells(cell))
                 arr = new_array_for(secd, meta_mem(cell));
             else {
-                arr = new_strref(secd, meta_mem(cell), sizeof(cell_t) * arrmeta_size(secd, cell));
+                arr = new_strref(secd, meta_mem(cell));
                 arr->type = CELL_BYTES;
             }
 
@@ -168,15 +195,14 @@ cell_t *serialize_cell(secd_t *secd, cell_t *cell) {
             opt = chain_index(secd, mcons_prev(cell), nextc);
         } break;
       case CELL_FRAME: {
-            cell_t *ioc = chain_index(secd, cell->as.frame.io, SECD_NIL);
-            cell_t *nextc = chain_index(secd, cell->as.frame.cons.cdr, ioc);
-            opt = chain_index(secd, cell->as.frame.cons.car, nextc);
+            cell_t *nextc = chain_index(secd, get_cdr(cell), SECD_NIL);
+            opt = chain_index(secd, get_car(cell), nextc);
         } break;
       case CELL_FREE: {
             cell_t *nextc = chain_index(secd, get_cdr(cell), SECD_NIL);
             opt = chain_index(secd, get_car(cell), nextc);
         } break;
-      case CELL_REF: opt = chain_index(secd, cell->as.ref, SECD_NIL); break;
+      case CELL_REF: opt = chain_index(secd, get_ref(cell), SECD_NIL); break;
       case CELL_ERROR: opt = chain_string(secd, errmsg(cell), SECD_NIL); break;
       case CELL_UNDEF: opt = SECD_NIL; break;
       case CELL_ARRAY: opt = chain_index(secd, arr_val(cell, -1), SECD_NIL); break;
@@ -199,6 +225,58 @@ cell_t *secd_mem_info(secd_t *secd) {
 }
 
 
+/* numbers are int: a counter that does not fit stays at INT_MAX */
+static cell_t *stats_number(secd_t *secd, size_t n) {
+    return new_number(secd, (n > INT_MAX ? INT_MAX : (int)n));
+}
+
+static cell_t *stats_entry(secd_t *secd, const char *key, size_t n, cell_t *rest) {
+    cell_t *entry = new_cons(secd, new_symbol(secd, key), stats_number(secd, n));
+    return new_cons(secd, entry, rest);
+}
+
+/* an alist of counters: (type total freed live) for every type of cells,
+ * where total is live + freed, then (name . number) */
+cell_t *secd_stats(secd_t *secd) {
+    heap_census_t census;
+    secd_heap_census(secd, &census);
+
+    const size_t cellsize = sizeof(cell_t);
+    cell_t *stats = SECD_NIL;
+    stats = stats_entry(secd, "compiled-instructions", secd->used_control, stats);
+    stats = stats_entry(secd, "peak-dump", secd->used_dump, stats);
+    stats = stats_entry(secd, "peak-stack", secd->used_stack, stats);
+    stats = stats_entry(secd, "compactions", secd->compactions, stats);
+    stats = stats_entry(secd, "emergency-gcs", secd->emergency_gcs, stats);
+    stats = stats_entry(secd, "major-usec", secd->major_usec, stats);
+    stats = stats_entry(secd, "major-gcs", secd->major_gcs, stats);
+    stats = stats_entry(secd, "minor-usec", secd->minor_usec, stats);
+    stats = stats_entry(secd, "minor-gcs", secd->minor_gcs, stats);
+    stats = stats_entry(secd, "array-largest-free", census.array_largest * cellsize, stats);
+    stats = stats_entry(secd, "array-free-areas", census.array_holes, stats);
+    stats = stats_entry(secd, "array-free-bytes", census.array_free * cellsize, stats);
+    stats = stats_entry(secd, "array-bytes", census.array_used * cellsize, stats);
+
+    enum cell_type t;
+    for (t = CELL_ERROR; t >= CELL_CONS; --t) {
+        if ((t == CELL_FREE) || (t == CELL_ARRMETA))
+            continue;
+        cell_t *counts = new_cons(secd, stats_number(secd, census.live[t]), SECD_NIL);
+        counts = new_cons(secd, stats_number(secd, secd->freed[t]), counts);
+        counts = new_cons(secd, stats_number(secd, census.live[t] + secd->freed[t]), counts);
+        stats = new_cons(secd, new_cons(secd, secd->type_syms[t], counts), stats);
+    }
+    return stats;
+}
+
+
+const enum cell_type secd_immediate_types[] = {
+    [IMM_CELL] = CELL_UNDEF,    // not used
+    [IMM_INT]  = CELL_INT,
+    [IMM_CHAR] = CELL_CHAR,
+    [IMM_BOOL] = CELL_SYM,
+};
+
 /*
  * Errors
  */
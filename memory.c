@@ -2,9 +2,13 @@
 #include "secd_io.h"
 #include "secdops.h"
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 /*
  *      A short description of SECD memory layout
@@ -13,6 +17,9 @@
  *  TODO
  */
 
+/* the base of all cellref_t, see ref_cell(); NULL till init_mem() */
+char *secd_heap;
+
 /* internal declarations */
 void free_array(secd_t *secd, cell_t *this);
 void push_free(secd_t *secd, cell_t *c);
@@ -84,13 +91,11 @@ cell_t *drop_dependencies(secd_t *secd, cell_t *c) {
     enum cell_type t = cell_type(c);
     switch (t) {
       case CELL_SYM:
-        if (c->as.sym.size != DONT_FREE_THIS)
-            free((char *)c->as.sym.data);
-            /* TODO: this silently ignores symbol memory corruption */
-            c->as.sym.size = DONT_FREE_THIS;
+        /* the name is interned */
         break;
       case CELL_FRAME:
-        drop_cell(secd, c->as.frame.io);
+        if (c->flags & FLAG_FRAMEIO)
+            --secd->io_frames;
         // fall through
       case CELL_CONS:
         if (not_nil(c)) {
@@ -98,18 +103,18 @@ cell_t *drop_dependencies(secd_t *secd, cell_t *c) {
             drop_cell(secd, get_cdr(c));
         }
         break;
-      case CELL_STR:
+      case CELL_STR: case CELL_BYTES:
       case CELL_ARRAY:
         drop_array(secd, arr_mem(c));
         break;
       case CELL_REF:
-        drop_cell(secd, c->as.ref);
+        drop_cell(secd, get_ref(c));
         break;
       case CELL_PORT:
         secd_pclose(secd, c);
         break;
       case CELL_ARRMETA:
-        if (c->as.mcons.cells) {
+        if (arrmeta_has_cells(c)) {
             size_t size = arrmeta_size(secd, c);
             size_t i;
 
@@ -132,26 +137,123 @@ cell_t *drop_dependencies(secd_t *secd, cell_t *c) {
 }
 
 cell_t *free_cell(secd_t *secd, cell_t *c) {
+    if (!is_refcounted(c) || is_young(secd, c))
+        return SECD_NIL;
+    if (is_symbol(c) && (symdata(c)->cell == c))
+        return SECD_NIL;    // interned
+    ++secd->freed[cell_type(c)];
     push_free(secd, drop_dependencies(secd, c));
     return SECD_NIL;
 }
 
 
-cell_t *pop_free(secd_t *secd) {
+/*
+ *      Heap growth
+ *  the whole heap is reserved at start, fixed cells and arrays
+ *  commit more of it when they need, from its ends towards each other
+ */
+
+static size_t page_cells = 0;    // cells in a whole number of pages
+
+inline static size_t round_to_pages(size_t ncells) {
+    return (ncells + page_cells - 1) / page_cells * page_cells;
+}
+
+/* a mark & sweep after the instruction, unless one is asked for already */
+inline static void ask_autogc(secd_t *secd) {
+    if ((secd->postop != SECDPOST_GC) && (secd->postop != SECDPOST_IMAGE))
+        secd->postop = SECDPOST_AUTOGC;
+}
+
+/* the part of the gap between fixed cells and arrays that allocations
+ * leave: a minor GC promotes up to the whole nursery there,
+ * an instruction that fills the heap finishes in GC_RESERVE */
+static size_t heap_reserve(secd_t *secd) {
+    size_t reserve = secd->nurseryend - secd->begin;
+    return (secd->gc_emergency ? reserve : reserve + GC_RESERVE);
+}
+
+/* commits at least `need` and up to `want` cells more for fixed cells
+ * or for arrays, `reserve` cells of the gap are left */
+static bool grow_heap(secd_t *secd, bool arrays, size_t need, size_t want, size_t reserve) {
+    size_t gap = secd->arraylimit - secd->fixedlimit;
+    gap = (gap > reserve ? gap - reserve : 0);
+    size_t more = round_to_pages(need > want ? need : want);
+    if (more > gap)
+        more = gap;
+    if (more < need)
+        return false;
+
+    cell_t *start = (arrays ? secd->arraylimit - more : secd->fixedlimit);
+    if (mprotect(start, more * sizeof(cell_t), PROT_READ | PROT_WRITE))
+        return false;
+
+    if (arrays)
+        secd->arraylimit = start;
+    else
+        secd->fixedlimit = start + more;
+    memdebugf(";; heap: %zd more cells for %s\n", more, (arrays ? "arrays" : "cells"));
+    return true;
+}
+
+/* grow_heap() for an allocation: if only GC_RESERVE is left, the
+ * instruction may finish in it and a mark & sweep follows it;
+ * an allocation that does not fit even then fails */
+static bool grow_heap_for(secd_t *secd, bool arrays, size_t need) {
+    /* the committed memory doubles if the reserved memory allows */
+    size_t have = (arrays ? secd->end - secd->arraylimit
+                          : secd->fixedlimit - secd->begin);
+    if (grow_heap(secd, arrays, need, have, heap_reserve(secd)))
+        return true;
+
+    if (!secd->gc_emergency) {
+        /* the reserve lasts till the GC after the instruction */
+        secd->gc_emergency = true;
+        ++secd->emergency_gcs;
+        ask_autogc(secd);
+        if (grow_heap(secd, arrays, need, have, heap_reserve(secd)))
+            return true;
+    }
+    errorf(";; heap: the limit of %zd cells is reached\n", secd->end - secd->begin);
+    return false;
+}
+
+bool commit_heap(secd_t *secd, size_t fixed, size_t arrays) {
+    size_t have = secd->fixedlimit - secd->begin;
+    bool ok = (have >= fixed) || grow_heap(secd, false, fixed - have, 0, 0);
+    have = secd->end - secd->arraylimit;
+    return ok && ((have >= arrays) || grow_heap(secd, true, arrays - have, 0, 0));
+}
+
+/* asks for a mark & sweep after the instruction when the old cells
+ * have grown enough or `room` is getting small */
+static void check_heap_pressure(secd_t *secd, size_t room) {
+    if (((size_t)(secd->fixedptr - secd->nurseryend) >= secd->gc_threshold)
+        || (room < secd->gc_gap_limit))
+    {
+        /* refcounting does not free cycles, e.g. letrec frames */
+        ask_autogc(secd);
+    }
+}
+
+/* an old cell, it is reference-counted */
+static cell_t *pop_old(secd_t *secd) {
     cell_t *cell;
     if (not_nil(secd->free)) {
         /* take a cell from the list */
         cell = secd->free;
         secd->free = get_cdr(secd->free);
         if (secd->free)
-            secd->free->as.cons.car = SECD_NIL;
+            set_car(secd, secd->free, SECD_NIL);
         memdebugf("NEW [%ld]\n", cell_index(secd, cell));
         -- secd->free_cells;
     } else {
         assert(secd->free_cells == 0,
                "pop_free: free=NIL when nfree=%zd\n", secd->free_cells);
+        check_heap_pressure(secd, secd->arraylimit - secd->fixedptr);
+
         /* move fixedptr */
-        if (secd->fixedptr >= secd->arrayptr)
+        if ((secd->fixedptr >= secd->fixedlimit) && !grow_heap_for(secd, false, 1))
             return &secd_out_of_memory;
 
         cell = secd->fixedptr;
@@ -160,6 +262,25 @@ cell_t *pop_free(secd_t *secd) {
     }
 
     cell->type = CELL_UNDEF;
+    cell->flags = 0;
+    cell->nref = 0;
+    return cell;
+}
+
+cell_t *pop_free(secd_t *secd) {
+    if (secd->nurseryptr == secd->nurserylimit) {
+        /* collect at the end of the instruction, cells are old till then */
+        if (secd->postop == SECD_NOPOST)
+            secd->postop = SECDPOST_MINORGC;
+        cell_t *cell = pop_old(secd);
+        if (!is_error(cell))
+            defer_free(secd, cell);
+        return cell;
+    }
+
+    cell_t *cell = secd->nurseryptr++;
+    cell->type = CELL_UNDEF;
+    cell->flags = 0;
     cell->nref = 0;
     return cell;
 }
@@ -173,11 +294,11 @@ void push_free(secd_t *secd, cell_t *c) {
     if (c + 1 < secd->fixedptr) {
         /* just add the cell to the list secd->free */
         c->type = CELL_FREE;
-        c->as.cons.car = SECD_NIL;
-        c->as.cons.cdr = secd->free;
+        set_car(secd, c, SECD_NIL);
+        set_cdr(secd, c, secd->free);
 
         if (not_nil(secd->free))
-            secd->free->as.cons.car = c;
+            set_car(secd, secd->free, c);
         secd->free = c;
 
         ++secd->free_cells;
@@ -190,18 +311,18 @@ void push_free(secd_t *secd, cell_t *c) {
         while (c->type == CELL_FREE) {
             /* it is a cell adjacent to the free space */
             if (c != secd->free) {
-                cell_t *prev = c->as.cons.car;
-                cell_t *next = c->as.cons.cdr;
+                cell_t *prev = get_car(c);
+                cell_t *next = get_cdr(c);
                 if (not_nil(prev)) {
-                    prev->as.cons.cdr = next;
+                    set_cdr(secd, prev, next);
                 }
                 if (not_nil(next)) {
-                    next->as.cons.car = prev;
+                    set_car(secd, next, prev);
                 }
             } else {
-                cell_t *next = c->as.cons.cdr;
+                cell_t *next = get_cdr(c);
                 if (not_nil(next))
-                    next->as.cons.car = SECD_NIL;
+                    set_car(secd, next, SECD_NIL);
 
                 secd->free = next;
             }
@@ -221,50 +342,138 @@ void push_free(secd_t *secd, cell_t *c) {
 /* checks if the array described by the metadata cons is free */
 static inline bool is_array_free(secd_t *secd, cell_t *metacons) {
     if (metacons == secd->arrlist) return false;
-    return metacons->as.mcons.free;
+    return metacons->flags & FLAG_ARRFREE;
 }
 static inline void mark_free(cell_t *metacons, bool free) {
-    metacons->as.mcons.free = free;
+    if (free)
+        metacons->flags |= FLAG_ARRFREE;
+    else
+        metacons->flags &= ~FLAG_ARRFREE;
+}
+
+static inline void set_mcons_prev(cell_t *meta, cell_t *prev) {
+    meta->as.mcons.prev = cell_ref(prev);
+}
+static inline void set_mcons_next(cell_t *meta, cell_t *next) {
+    meta->as.mcons.next = cell_ref(next);
 }
 
 static cell_t *init_meta(secd_t __unused *secd, cell_t *cell, cell_t *prev, cell_t *next) {
     cell->type = CELL_ARRMETA;
     cell->nref = 0;
-    cell->as.mcons.prev = prev;
-    cell->as.mcons.next = next;
-    cell->as.mcons.cells = false;
+    set_mcons_prev(cell, prev);
+    set_mcons_next(cell, next);
+    cell->flags = 0;
     return cell;
 }
 
+/*
+ *  free areas are linked in lists by size through their first cell,
+ *  empty ones are in no list: they only wait to be merged
+ */
+
+static inline int arr_class(size_t size) {
+    if (size <= ARR_SMALL)
+        return size - 1;
+    int log2 = 8 * sizeof(long) - 1 - __builtin_clzl(size);
+    return ARR_SMALL + log2 - 5;
+}
+
+static inline cell_t *free_link(cell_t *meta) {
+    return meta_mem(meta);
+}
+
+static void list_free_area(secd_t *secd, cell_t *meta) {
+    size_t size = arrmeta_size(secd, meta);
+    if (size == 0)
+        return;
+
+    int cls = arr_class(size);
+    cell_t *head = secd->arrfree[cls];
+    cell_t *link = free_link(meta);
+    link->type = CELL_FREE;
+    link->as.mcons.prev = cell_ref(SECD_NIL);
+    link->as.mcons.next = cell_ref(head);
+    if (not_nil(head))
+        free_link(head)->as.mcons.prev = cell_ref(meta);
+
+    secd->arrfree[cls] = meta;
+    secd->arrfree_map |= (1ull << cls);
+}
+
+static void unlist_free_area(secd_t *secd, cell_t *meta) {
+    size_t size = arrmeta_size(secd, meta);
+    if (size == 0)
+        return;
+
+    int cls = arr_class(size);
+    cell_t *link = free_link(meta);
+    cell_t *prev = ref_cell(link->as.mcons.prev);
+    cell_t *next = ref_cell(link->as.mcons.next);
+    if (not_nil(next))
+        free_link(next)->as.mcons.prev = cell_ref(prev);
+    if (not_nil(prev)) {
+        free_link(prev)->as.mcons.next = cell_ref(next);
+    } else {
+        secd->arrfree[cls] = next;
+        if (is_nil(next))
+            secd->arrfree_map &= ~(1ull << cls);
+    }
+}
+
+/* a free area of at least `size` cells, unlisted; NIL if none */
+static cell_t *find_free_area(secd_t *secd, size_t size) {
+    if (size == 0)
+        size = 1;   // empty areas are not listed
+    int cls = arr_class(size);
+
+    /* any area of a larger class fits; the smallest of them is taken */
+    int from = (size <= ARR_SMALL ? cls : cls + 1);
+    uint64_t larger = (from < 64 ? secd->arrfree_map & (~0ull << from) : 0);
+    if (larger) {
+        cell_t *meta = secd->arrfree[__builtin_ctzll(larger)];
+        unlist_free_area(secd, meta);
+        return meta;
+    }
+
+    /* some of its own class may fit */
+    cell_t *meta = secd->arrfree[cls];
+    while (not_nil(meta)) {
+        if (arrmeta_size(secd, meta) >= size) {
+            unlist_free_area(secd, meta);
+            return meta;
+        }
+        meta = ref_cell(free_link(meta)->as.mcons.next);
+    }
+    return SECD_NIL;
+}
+
 cell_t *alloc_array(secd_t *secd, size_t size) {
-    /* look through the list of arrays */
-    cell_t *cur = secd->arrlist;
-    while (not_nil(mcons_next(cur))) {
-        if (is_array_free(secd, cur)) {
-            size_t cursize = arrmeta_size(secd, cur);
-            if (cursize >= size) {
-                /* allocate this gap */
-                if (cursize > size + 1) {
-                    /* make a free gap after */
-                    cell_t *newmeta = cur + size + 1;
-                    cell_t *prevmeta = mcons_prev(cur);
-                    init_meta(secd, newmeta, prevmeta, cur);
-
-                    cur->as.mcons.prev = newmeta;
-                    prevmeta->as.mcons.next = newmeta;
-
-                    mark_free(newmeta, true);
-                }
-                mark_free(cur, false);
-                return meta_mem(cur);
-            }
+    cell_t *cur = find_free_area(secd, size);
+    if (not_nil(cur)) {
+        size_t cursize = arrmeta_size(secd, cur);
+        if (cursize > size) {
+            /* make a free gap after, maybe an empty one:
+             * the size of an array is the size of its gap */
+            cell_t *newmeta = cur + size + 1;
+            cell_t *prevmeta = mcons_prev(cur);
+            init_meta(secd, newmeta, prevmeta, cur);
+
+            set_mcons_prev(cur, newmeta);
+            set_mcons_next(prevmeta, newmeta);
+
+            mark_free(newmeta, true);
+            list_free_area(secd, newmeta);
         }
-        cur = mcons_next(cur);
+        cur->flags = 0;
+        return meta_mem(cur);
     }
 
     /* no chunks of sufficient size found, move secd->arrayptr */
-    if (secd->arrayptr - secd->fixedptr <= (int)size)
+    size_t room = secd->arrayptr - secd->arraylimit;
+    if ((room < size + 1) && !grow_heap_for(secd, true, size + 1 - room))
         return &secd_out_of_memory;
+    check_heap_pressure(secd, secd->arrayptr - secd->fixedlimit);
 
     /* create new metadata cons at arrayptr - size - 1 */
     cell_t *oldmeta = secd->arrayptr;
@@ -272,7 +481,7 @@ cell_t *alloc_array(secd_t *secd, size_t size) {
     cell_t *meta = oldmeta - size - 1;
     init_meta(secd, meta, oldmeta, SECD_NIL);
 
-    oldmeta->as.mcons.next = meta;
+    set_mcons_next(oldmeta, meta);
 
     secd->arrayptr = meta;
 
@@ -294,34 +503,131 @@ void free_array(secd_t *secd, cell_t *mem) {
     if (meta != secd->arrayptr) {
         if (is_array_free(secd, prev)) {
             /* merge with the previous array */
-            cell_t *pprev = prev->as.mcons.prev;
-            pprev->as.mcons.next = meta;
-            meta->as.mcons.prev = pprev;
+            unlist_free_area(secd, prev);
+            cell_t *pprev = mcons_prev(prev);
+            set_mcons_next(pprev, meta);
+            set_mcons_prev(meta, pprev);
         }
 
         cell_t *next = mcons_next(meta);
         if (is_array_free(secd, next)) {
             /* merge with the next array */
-            cell_t *newprev = meta->as.mcons.prev;
-            next->as.mcons.prev = newprev;
-            newprev->as.mcons.next = next;
+            unlist_free_area(secd, next);
+            cell_t *newprev = mcons_prev(meta);
+            set_mcons_prev(next, newprev);
+            set_mcons_next(newprev, next);
+            meta = next;
         }
         mark_free(meta, true);
+        list_free_area(secd, meta);
     } else {
         /* move arrayptr into the array area */
-        prev->as.mcons.next = SECD_NIL;
+        set_mcons_next(prev, SECD_NIL);
         secd->arrayptr = prev;
 
         if (is_array_free(secd, prev)) {
             /* at most one array after 'arr' may be free */
-            cell_t *pprev = prev->as.mcons.prev;
-            pprev->as.mcons.next = SECD_NIL;
+            unlist_free_area(secd, prev);
+            cell_t *pprev = mcons_prev(prev);
+            set_mcons_next(pprev, SECD_NIL);
             secd->arrayptr = pprev;
         }
     }
     memdebugf("FREE ARR[%ld]", cell_index(secd, meta));
 }
 
+/*
+ *  Compaction: slides the used arrays towards arrlist, no free areas
+ *  are left; only when all cells are counted and the nursery is empty
+ */
+
+/* the new place of a used array is kept in its prev link meanwhile */
+static inline cell_t *moved_meta(cell_t *meta) {
+    return mcons_prev(meta);
+}
+
+static void move_array_ref(cell_t *cell) {
+    switch (cell_type(cell)) {
+      case CELL_ARRAY: case CELL_STR: case CELL_BYTES: {
+        /* as.arr.data and as.str.data are the same */
+        cell_t *meta = ref_cell(cell->as.arr.data) - 1;
+        cell->as.arr.data = cell_ref(meta_mem(moved_meta(meta)));
+      } break;
+      default: break;
+    }
+}
+
+static size_t free_array_cells(secd_t *secd) {
+    size_t nfree = 0;
+    cell_t *meta;
+    for (meta = mcons_next(secd->arrlist); not_nil(meta); meta = mcons_next(meta))
+        if (is_array_free(secd, meta))
+            nfree += arrmeta_size(secd, meta) + 1;
+    return nfree;
+}
+
+static void compact_arrays(secd_t *secd) {
+    size_t ipoffset = 0;
+    if (not_nil(secd->control))
+        ipoffset = secd->ip - code_instrs(secd->control);
+
+    /* plan: where every used array goes */
+    cell_t *dest = secd->arrlist;
+    cell_t *oldprev = secd->arrlist;
+    cell_t *meta;
+    for (meta = mcons_next(oldprev); not_nil(meta); meta = mcons_next(meta)) {
+        size_t size = oldprev - meta - 1;
+        oldprev = meta;
+        if (is_array_free(secd, meta))
+            continue;
+        dest -= size + 1;
+        set_mcons_prev(meta, dest);
+    }
+
+    /* update the references: the cells, then the items of arrays */
+    cell_t *cell;
+    for (cell = secd->nurseryend; cell < secd->fixedptr; ++cell)
+        move_array_ref(cell);
+
+    oldprev = secd->arrlist;
+    for (meta = mcons_next(oldprev); not_nil(meta); meta = mcons_next(meta)) {
+        size_t size = oldprev - meta - 1;
+        oldprev = meta;
+        if (is_array_free(secd, meta) || !arrmeta_has_cells(meta))
+            continue;
+        size_t i;
+        for (i = 0; i < size; ++i)
+            move_array_ref(meta_mem(meta) + i);
+    }
+
+    /* move: every array goes up, over the ones moved already */
+    cell_t *newprev = secd->arrlist;
+    oldprev = secd->arrlist;
+    meta = mcons_next(oldprev);
+    while (not_nil(meta)) {
+        cell_t *next = mcons_next(meta);
+        size_t size = oldprev - meta - 1;
+        oldprev = meta;
+        if (!is_array_free(secd, meta)) {
+            cell_t *newmeta = moved_meta(meta);
+            memmove(newmeta, meta, (size + 1) * sizeof(cell_t));
+            set_mcons_prev(newmeta, newprev);
+            set_mcons_next(newprev, newmeta);
+            newprev = newmeta;
+        }
+        meta = next;
+    }
+    set_mcons_next(newprev, SECD_NIL);
+    secd->arrayptr = newprev;
+
+    memset(secd->arrfree, 0, sizeof(secd->arrfree));
+    secd->arrfree_map = 0;
+
+    if (not_nil(secd->control))
+        secd->ip = code_instrs(secd->control) + ipoffset;
+    ++secd->compactions;
+}
+
 void print_array_layout(secd_t *secd) {
     errorf(";; Array heap layout:\n");
     errorf(";;  arrayptr = %ld\n", cell_index(secd, secd->arrayptr));
@@ -336,6 +642,33 @@ void print_array_layout(secd_t *secd) {
     }
 }
 
+void secd_heap_census(secd_t *secd, heap_census_t *census) {
+    memset(census, 0, sizeof(heap_census_t));
+
+    cell_t *cell;
+    for (cell = secd->begin; cell < secd->nurseryptr; ++cell)
+        ++census->live[cell_type(cell)];
+    for (cell = secd->nurseryend; cell < secd->fixedptr; ++cell)
+        if (cell_type(cell) != CELL_FREE)
+            ++census->live[cell_type(cell)];
+
+    cell_t *cur = secd->arrlist;
+    while (not_nil(mcons_next(cur))) {
+        cur = mcons_next(cur);
+        size_t size = arrmeta_size(secd, cur);
+        if (!is_array_free(secd, cur)) {
+            census->array_used += size;
+            continue;
+        }
+        if (size == 0)
+            continue;   /* alloc_array leaves empty free areas */
+        census->array_free += size;
+        ++census->array_holes;
+        if (size > census->array_largest)
+            census->array_largest = size;
+    }
+}
+
 /*
  *      Simple constructors
  */
@@ -343,19 +676,24 @@ void print_array_layout(secd_t *secd) {
 static inline cell_t*
 init_cons(secd_t *secd, cell_t *cell, cell_t *car, cell_t *cdr) {
     cell->type = CELL_CONS;
-    cell->as.cons.car = share_cell(secd, car);
-    cell->as.cons.cdr = share_cell(secd, cdr);
+    set_car(secd, cell, share_cell(secd, car));
+    set_cdr(secd, cell, share_cell(secd, cdr));
     return cell;
 }
 
+/* allocators return &secd_out_of_memory as it is, see pop_old() */
 cell_t *new_cons(secd_t *secd, cell_t *car, cell_t *cdr) {
-    return init_cons(secd, pop_free(secd), car, cdr);
+    cell_t *cell = pop_free(secd);
+    if (is_error(cell))
+        return cell;
+    return init_cons(secd, cell, car, cdr);
 }
 
 cell_t *new_frame(secd_t *secd, cell_t *syms, cell_t *vals) {
     cell_t *cons = new_cons(secd, syms, vals);
+    if (is_error(cons))
+        return cons;
     cons->type = CELL_FRAME;
-    /* don't forget to initialize as.frame.io later */
     return cons;
 }
 
@@ -366,28 +704,145 @@ cell_t *init_number(cell_t *c, int n) {
 }
 
 cell_t *new_number(secd_t *secd, int num) {
+    if (fits_immediate(num))
+        return make_immediate(IMM_INT, num);
+
     cell_t *cell = pop_free(secd);
+    if (is_error(cell))
+        return cell;
     return init_number(cell, num);
 }
 
-cell_t *new_char(secd_t *secd, int c) {
-    cell_t *cell = pop_free(secd);
-    cell->type = CELL_CHAR;
-    cell->as.num = c;
-    return cell;
+cell_t *new_char(secd_t __unused *secd, int c) {
+    return make_immediate(IMM_CHAR, c);
 }
 
-cell_t *new_symbol(secd_t *secd, const char *sym) {
-    cell_t *cell = pop_free(secd);
+/* #f and #t are immediate, -1 for other symbols */
+static int boolean_for_name(const char *sym) {
+    if (sym[0] != '#' || sym[1] == '\0' || sym[2] != '\0')
+        return -1;
+    if (str_eq(sym, SECD_FALSE)) return false;
+    if (str_eq(sym, SECD_TRUE))  return true;
+    return -1;
+}
+
+/*
+ *  Symbols
+ *  every name is interned once with its symbol cell,
+ *  secd->symtab holds a reference to the cell through its symdata_t
+ */
+
+#define SYMTAB_INITSIZE 1024
+
+/* the same for names equal by str_eq() */
+static hash_t symkey(const char *name) {
+#if CASESENSITIVE
+    return strhash(name);
+#else
+    uint32_t hash = 0;
+    while (*name) {
+        hash += tolower((unsigned char)*name);
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+        ++name;
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+#endif
+}
+
+static bool grow_symtab(secd_t *secd) {
+    size_t newsize = (secd->symtab_size ? 2 * secd->symtab_size : SYMTAB_INITSIZE);
+    symdata_t **newtab = calloc(newsize, sizeof(symdata_t *));
+    if (!newtab)
+        return false;
+
+    size_t i;
+    for (i = 0; i < secd->symtab_size; ++i) {
+        symdata_t *sd = secd->symtab[i];
+        if (!sd)
+            continue;
+        size_t j = sd->key & (newsize - 1);
+        while (newtab[j])
+            j = (j + 1) & (newsize - 1);
+        newtab[j] = sd;
+    }
+    free(secd->symtab);
+    secd->symtab = newtab;
+    secd->symtab_size = newsize;
+    return true;
+}
+
+/* the symbol for the name; `cell` becomes it if the name is new,
+ * a new cell if `cell` is NIL */
+static cell_t *intern_symbol_in(secd_t *secd, const char *name, cell_t *cell) {
+    if ((2 * (secd->nsyms + 1) > secd->symtab_size) && !grow_symtab(secd))
+        return &secd_out_of_memory;
+
+    hash_t key = symkey(name);
+    size_t mask = secd->symtab_size - 1;
+    size_t i = key & mask;
+    const symdata_t *folded = NULL;
+    const symdata_t *found;
+    while ((found = secd->symtab[i])) {
+        if ((found->key == key) && str_eq(found->name, name)) {
+            if (!strcmp(found->name, name))
+                return found->cell;
+            folded = found->folded;
+        }
+        i = (i + 1) & mask;
+    }
+
+    size_t size = strlen(name) + 1;
+    symdata_t *sd = malloc(sizeof(symdata_t) + size);
+    if (!sd)
+        return &secd_out_of_memory;
+    if (is_nil(cell)) {
+        cell = pop_old(secd);
+        if (is_error(cell)) {
+            free(sd);
+            return cell;
+        }
+        cell->nref = 1;
+    }
+
+    memcpy(sd->name, name, size);
+    sd->cell = cell;
+    sd->folded = (folded ? folded : sd);
+    sd->opcode = opcode_for_name(name);
+    sd->key = key;
+    sd->hash = strhash(name);
+
     cell->type = CELL_SYM;
-    cell->as.sym.size = strlen(sym);
-    cell->as.sym.data = strdup(sym);
-    cell->as.sym.hash = memhash(sym, cell->as.sym.size);
+    cell->as.sym.data = sd->name;
+
+    secd->symtab[i] = sd;
+    ++secd->nsyms;
     return cell;
 }
 
+static cell_t *intern_symbol(secd_t *secd, const char *name) {
+    return intern_symbol_in(secd, name, SECD_NIL);
+}
+
+cell_t *intern_symbol_at(secd_t *secd, cell_t *cell, const char *name) {
+    return intern_symbol_in(secd, name, cell);
+}
+
+cell_t *new_symbol(secd_t *secd, const char *sym) {
+    int boolean = boolean_for_name(sym);
+    if (boolean >= 0)
+        return make_immediate(IMM_BOOL, boolean);
+
+    return intern_symbol(secd, sym);
+}
+
 cell_t *new_op(secd_t *secd, opindex_t opind) {
     cell_t *cell = pop_free(secd);
+    if (is_error(cell))
+        return cell;
     cell->type = CELL_OP;
     cell->as.op = opind;
     return cell;
@@ -395,8 +850,10 @@ cell_t *new_op(secd_t *secd, opindex_t opind) {
 
 cell_t *new_array_for(secd_t *secd, cell_t *mem) {
     cell_t *arr = pop_free(secd);
+    if (is_error(arr))
+        return arr;
     arr->type = CELL_ARRAY;
-    arr->as.arr.data = share_array(secd, mem);
+    arr->as.arr.data = cell_ref(share_array(secd, mem));
     arr->as.arr.offset = 0;
     return arr;
 }
@@ -405,7 +862,9 @@ cell_t *new_array(secd_t *secd, size_t size) {
     /* try to allocate memory */
     cell_t *mem = alloc_array(secd, size);
     assert_cell(mem, "new_array: memory allocation failed");
-    arr_meta(mem)->as.mcons.cells = true;
+    arr_meta(mem)->flags |= FLAG_ARRCELLS;
+    /* the items are CELL_UNDEF, they are scanned by collectors */
+    memset(mem, 0, size * sizeof(cell_t));
 
     return new_array_for(secd, mem);
 }
@@ -413,32 +872,39 @@ cell_t *new_array(secd_t *secd, size_t size) {
 /*
  *  String allocation
  */
-static cell_t *init_strref(secd_t *secd, cell_t *cell, cell_t *mem, size_t size) {
+static cell_t *init_strref(secd_t *secd, cell_t *cell, cell_t *mem) {
     cell->type = CELL_STR;
 
-    cell->as.str.data = (char *)share_array(secd, mem);
+    cell->as.str.data = cell_ref(share_array(secd, mem));
     cell->as.str.offset = 0;
-    cell->as.str.size = size;
     return cell;
 }
 
-cell_t *new_strref(secd_t *secd, cell_t *mem, size_t size) {
+cell_t *new_strref(secd_t *secd, cell_t *mem) {
     cell_t *ref = pop_free(secd);
     assert_cell(ref, "new_strref: allocation failed");
-    return init_strref(secd, ref, mem, size);
+    return init_strref(secd, ref, mem);
 }
 
 cell_t *new_string_of_size(secd_t *secd, size_t size) {
+    assert(size <= UINT32_MAX, "new_string_of_size: too large");
     cell_t *mem;
-    mem = alloc_array(secd, bytes_to_cell(size));
+    size_t ncells = bytes_to_cell(size);
+    mem = alloc_array(secd, ncells);
     assert_cell(mem, "new_string_of_size: alloc failed");
 
-    return new_strref(secd, mem, size);
+    /* the exact size is kept by the metadata, see mem_size() */
+    size_t pad = ncells * sizeof(cell_t) - size;
+    arr_meta(mem)->flags |= pad << FLAG_ARRPAD_SHIFT;
+
+    return new_strref(secd, mem);
 }
 
 cell_t *new_string(secd_t *secd, const char *str) {
     size_t size = strlen(str) + 1;
     cell_t *cell = new_string_of_size(secd, size);
+    if (is_error(cell))
+        return cell;
 
     strcpy(strmem(cell), str);
     return cell;
@@ -446,6 +912,8 @@ cell_t *new_string(secd_t *secd, const char *str) {
 
 cell_t *new_bytevector_of_size(secd_t *secd, size_t size) {
     cell_t *c = new_string_of_size(secd, size);
+    if (is_error(c))
+        return c;
     c->type = CELL_BYTES;
     return c;
 }
@@ -456,23 +924,21 @@ cell_t *new_bytevector_of_size(secd_t *secd, size_t size) {
 static cell_t *init_port_mode(secd_t *secd, cell_t *cell, const char *mode) {
     switch (mode[0]) {
       case 'r':
-        cell->as.port.input = true;
+        cell->flags |= FLAG_PORTIN;
         if (mode[1] == '+') {
-            cell->as.port.output = true;
+            cell->flags |= FLAG_PORTOUT;
             ++mode;
-        } else
-            cell->as.port.output = false;
+        }
         if (mode[1] == '\0')
             return cell;
         break;
 
       case 'w': case 'a':
-        cell->as.port.output = true;
+        cell->flags |= FLAG_PORTOUT;
         if (mode[1] == '+') {
-            cell->as.port.input = true;
+            cell->flags |= FLAG_PORTIN;
             ++mode;
-        } else
-            cell->as.port.input = false;
+        }
         if (mode[1] == '\0')
             return cell;
     }
@@ -487,8 +953,9 @@ cell_t *new_strport(secd_t *secd, cell_t *str, const char *mode) {
     assert_cell(cell, "new_fileport: allocation failed");
 
     cell->type = CELL_PORT;
-    cell->as.port.file = false;
-    cell->as.port.as.str = str;
+    cell->flags = 0;
+    cell->as.port.as.str = cell_ref(share_cell(secd, str));
+    write_barrier(secd, cell, str);
     return init_port_mode(secd, cell, mode);
 }
 
@@ -497,7 +964,7 @@ cell_t *new_fileport(secd_t *secd, void *f, const char *mode) {
     assert_cell(cell, "new_fileport: allocation failed");
 
     cell->type = CELL_PORT;
-    cell->as.port.file = true;
+    cell->flags = FLAG_PORTFILE;
     cell->as.port.as.file = f;
     return init_port_mode(secd, cell, mode);
 }
@@ -506,23 +973,57 @@ cell_t *new_fileport(secd_t *secd, void *f, const char *mode) {
 /*
  *      Copy constructors
  */
+
+/* the references of a cell that may lead to young cells */
+static int young_ref_slots(cell_t *cell, cellref_t *slots[2]) {
+    switch (cell_type(cell)) {
+      case CELL_CONS: case CELL_FRAME:
+        slots[0] = &cell->as.cons.car;
+        slots[1] = &cell->as.cons.cdr;
+        return 2;
+      case CELL_REF:
+        slots[0] = &cell->as.ref;
+        return 1;
+      case CELL_PORT:
+        if (is_fileport(cell))
+            return 0;
+        slots[0] = &cell->as.port.as.str;
+        return 1;
+      default:
+        return 0;
+    }
+}
+
 cell_t *init_with_copy(secd_t *secd,
                        cell_t *__restrict cell,
                        const cell_t *__restrict with)
 {
+    if (is_immediate(with)) {
+        /* e.g. an item of an array, it is a cell */
+        cell->nref = 0;
+        if (is_symbol(with)) {
+            cell_t *sym = intern_symbol(secd, symname(with));
+            assert_cell(sym, "init_with_copy: no memory for a symbol");
+            cell->type = CELL_SYM;
+            cell->as.sym.data = sym->as.sym.data;
+            return cell;
+        }
+        cell->type = cell_type(with);
+        cell->as.num = numval(with);
+        return cell;
+    }
+
     *cell = *with;
 
     cell->nref = 0;
+    cell->flags &= ~FLAG_REMEMBERED;    // the copy is not in the set
     switch (cell_type(with)) {
       case CELL_CONS: case CELL_FRAME:
-        share_cell(secd, with->as.cons.car);
-        share_cell(secd, with->as.cons.cdr);
-        break;
-      case CELL_SYM:
-        cell->as.sym.data = strdup(symname(with));
+        share_cell(secd, get_car(with));
+        share_cell(secd, get_cdr(with));
         break;
       case CELL_REF:
-        share_cell(secd, with->as.ref);
+        share_cell(secd, get_ref(with));
         break;
       case CELL_ARRAY:
         share_array(secd, arr_mem(with));
@@ -533,7 +1034,7 @@ cell_t *init_with_copy(secd_t *secd,
       case CELL_PORT:
         /* TODO */
         break;
-      case CELL_INT: case CELL_CHAR:
+      case CELL_INT: case CELL_CHAR: case CELL_SYM:
       case CELL_OP: case CELL_FUNC:
       case CELL_ERROR: case CELL_UNDEF:
         break;
@@ -541,17 +1042,51 @@ cell_t *init_with_copy(secd_t *secd,
         errorf("init_with_copy: CELL_ARRMETA/CELL_FREE\n");
         return new_error(secd, "trying to initialize with CELL_ARRMETA/CELL_FREE");
     }
+
+    cellref_t *slots[2];
+    int i, n = young_ref_slots(cell, slots);
+    for (i = 0; i < n; ++i)
+        write_barrier(secd, cell, ref_cell(*slots[i]));
     return cell;
 }
 
+/* an immediate value equal to the cell or NIL */
+static cell_t *immediate_for(secd_t *secd, const cell_t *cell) {
+    switch (cell_type(cell)) {
+      case CELL_INT:
+        if (fits_immediate(numval(cell)))
+            return new_number(secd, numval(cell));
+        return SECD_NIL;
+      case CELL_CHAR:
+        return new_char(secd, numval(cell));
+      case CELL_SYM:
+        /* the interned one */
+        if (boolean_for_name(symname(cell)) >= 0)
+            return new_symbol(secd, symname(cell));
+        return symdata(cell)->cell;
+      default:
+        return SECD_NIL;
+    }
+}
+
 cell_t *new_const_clone(secd_t *secd, const cell_t *from) {
     if (is_nil(from)) return NULL;
 
+    cell_t *imm = immediate_for(secd, from);
+    if (not_nil(imm))
+        return imm;
+
     cell_t *clone = pop_free(secd);
+    if (is_error(clone))
+        return clone;
     return init_with_copy(secd, clone, from);
 }
 
 cell_t *new_clone(secd_t *secd, cell_t *from) {
+    cell_t *imm = immediate_for(secd, from);
+    if (not_nil(imm))
+        return imm;
+
     cell_t *clone = pop_free(secd);
     assert_cell(clone, "new_clone: allocation failed");
 
@@ -563,7 +1098,6 @@ cell_t *new_clone(secd_t *secd, cell_t *from) {
  */
 static cell_t *init_error(cell_t *cell, const char *buf) {
     cell->type = CELL_ERROR;
-    cell->as.err.len = strlen(buf);
     cell->as.err.msg = strdup(buf);
     return cell;
 }
@@ -572,7 +1106,10 @@ cell_t *new_errorv(secd_t *secd, const char *fmt, va_list va) {
 #define MAX_ERROR_SIZE  512
     char buf[MAX_ERROR_SIZE];
     vsnprintf(buf, MAX_ERROR_SIZE, fmt, va);
-    return init_error(pop_free(secd), buf);
+    cell_t *cell = pop_free(secd);
+    if (is_error(cell))
+        return cell;
+    return init_error(cell, buf);
 }
 
 cell_t *new_error(secd_t *secd, const char *fmt, ...) {
@@ -602,10 +1139,8 @@ inline static cell_t *list_push(secd_t *secd, cell_t **to, cell_t *what) {
 
 #if MEMDEBUG
     const char *src;
-    if (*to == secd->stack)        src = "S";
-    else if (*to == secd->env)     src = "E";
+    if (*to == secd->env)     src = "E";
     else if (*to == secd->control) src = "C";
-    else if (*to == secd->dump)    src = "D";
     else                           src = "?";
     memdebugf("PUSH %s[%ld (%ld, %ld)]\n", src, cell_index(secd, newtop),
             cell_index(secd, what), cell_index(secd, *to));
@@ -625,10 +1160,8 @@ inline static cell_t *list_pop(secd_t *secd, cell_t **from) {
 
 #if MEMDEBUG
     const char *src;
-    if (*from == secd->stack)        src = "S";
-    else if (*from == secd->env)     src = "E";
+    if (*from == secd->env)     src = "E";
     else if (*from == secd->control) src = "C";
-    else if (*from == secd->dump)    src = "D";
     else                             src = "?";
     memdebugf("POP %s[%ld] (%ld, %ld)\n", src,
             cell_index(secd, top),
@@ -638,36 +1171,58 @@ inline static cell_t *list_pop(secd_t *secd, cell_t **from) {
     return val; // don't forget to drop_cell()
 }
 
-cell_t *push_stack(secd_t *secd, cell_t *newc) {
-    return list_push(secd, &secd->stack, newc);
+#define STACK_INITSIZE  256
+#define REMEMBERED_INITSIZE 256
+#define ZCT_INITSIZE    4096
+
+cell_t *grow_stack(secd_t *secd) {
+    size_t size = secd->stacklimit - secd->stack;
+    size_t newsize = (size ? 2 * size : STACK_INITSIZE);
+
+    cell_t **newstack = realloc(secd->stack, newsize * sizeof(cell_t *));
+    if (!newstack)
+        return new_error(secd, "push: no memory for the stack");
+
+    secd->stackbase = newstack + (secd->stackbase - secd->stack);
+    secd->stackptr = newstack + (secd->stackptr - secd->stack);
+    secd->stacklimit = newstack + newsize;
+    secd->stack = newstack;
+    return SECD_NIL;
 }
 
-cell_t *pop_stack(secd_t *secd) {
-    return list_pop(secd, &secd->stack);
+cell_t *stack_list(secd_t *secd) {
+    cell_t *lst = SECD_NIL;
+    cell_t **val;
+    for (val = secd->stackbase; val < secd->stackptr; ++val)
+        lst = new_cons(secd, *val, lst);
+    return lst;
 }
 
 cell_t *set_control(secd_t *secd, cell_t **opcons) {
-    assert(is_cons(*opcons),
-           "set_control: failed, not a cons at [%ld]\n", cell_index(secd, *opcons));
     compile_ctrl(secd, opcons, SECD_NIL);
     assert_cell(*opcons, "set_control: failed to compile control path");
-    assert(cell_type(*opcons) == CELL_CONS, "set_control: not a cons");
-    assert(cell_type(get_car(*opcons)) == CELL_OP, "set_control: not an ATOM_OP");
-    return assign_cell(secd, &secd->control, *opcons);
-}
+    assert(is_control_compiled(*opcons),
+           "set_control: failed, not a control path at [%ld]\n", cell_index(secd, *opcons));
 
-cell_t *pop_control(secd_t *secd) {
-    return list_pop(secd, &secd->control);
+    secd->control = *opcons;
+    secd->ip = code_instrs(secd->control);
+    return secd->control;
 }
 
-cell_t *push_dump(secd_t *secd, cell_t *cell) {
-    ++secd->used_dump;
-    return list_push(secd, &secd->dump, cell);
-}
+#define DUMP_INITSIZE   64
+
+cell_t *grow_dump(secd_t *secd) {
+    size_t size = secd->dumplimit - secd->dump;
+    size_t newsize = (size ? 2 * size : DUMP_INITSIZE);
 
-cell_t *pop_dump(secd_t *secd) {
-    --secd->used_dump;
-    return list_pop(secd, &secd->dump);
+    callframe_t *newdump = realloc(secd->dump, newsize * sizeof(callframe_t));
+    if (!newdump)
+        return new_error(secd, "push_dump: no memory for the dump");
+
+    secd->dumpptr = newdump + (secd->dumpptr - secd->dump);
+    secd->dumplimit = newdump + newsize;
+    secd->dump = newdump;
+    return SECD_NIL;
 }
 
 /*
@@ -686,12 +1241,14 @@ size_t list_length(secd_t *secd, cell_t *lst) {
 }
 
 cell_t *fill_array(secd_t *secd, cell_t *arr, cell_t *with) {
-    cell_t *data = arr->as.arr.data;
+    cell_t *data = arr_mem(arr);
     size_t len = arr_size(secd, arr);
     size_t i;
 
     for (i = 0; i < len; ++i)
         init_with_copy(secd, data + i, with);
+    if (len > 0)
+        remember_item(secd, arr, data);
 
     return arr;
 }
@@ -705,6 +1262,7 @@ cell_t *list_to_vector(secd_t *secd, cell_t *lst) {
     for (i = 0; i < len; ++i) {
         if (is_nil(lst)) break;
         init_with_copy(secd, arr_ref(arr, i), get_car(lst));
+        remember_item(secd, arr, arr_ref(arr, i));
         lst = list_next(secd, lst);
     }
     return arr;
@@ -727,7 +1285,7 @@ cell_t *vector_to_list(secd_t *secd, cell_t *vct, int start, int end) {
     for (i = start; i < end; ++i) {
         cell_t *clone = new_clone(secd, arr_ref(vct, i));
         if (not_nil(lst)) {
-            cur->as.cons.cdr = share_cell(secd, new_cons(secd, clone, SECD_NIL));
+            set_cdr(secd, cur, share_cell(secd, new_cons(secd, clone, SECD_NIL)));
             cur = list_next(secd, cur);
         } else {
             lst = cur = new_cons(secd, clone, SECD_NIL);
@@ -821,7 +1379,6 @@ void secd_owned_cell_for(cell_t *cell,
           break;
       case CELL_FRAME:
           *ref1 = get_car(cell); *ref2 = get_cdr(cell);
-          *ref3 = cell->as.frame.io;
           break;
       case CELL_STR:
           *ref1 = arr_meta((cell_t*)strmem(cell));
@@ -830,10 +1387,10 @@ void secd_owned_cell_for(cell_t *cell,
           *ref1 = arr_meta(arr_mem(cell));
           break;
       case CELL_PORT:
-          if (!cell->as.port.file)
-              *ref1 = cell->as.port.as.str;
+          if (!is_fileport(cell))
+              *ref1 = port_str(cell);
           break;
-      case CELL_REF: *ref1 = cell->as.ref; break;
+      case CELL_REF: *ref1 = get_ref(cell); break;
       default: break;
     }
 }
@@ -847,6 +1404,9 @@ cell_t *secd_referers_for(secd_t *secd, cell_t *cell) {
 
     cell_t *ith;
     for (ith = secd->begin; ith < secd->fixedptr; ++ith) {
+        if (ith == secd->nurseryptr)
+            ith = secd->nurseryend;
+
         cell_t *ref1, *ref2, *ref3;
         secd_owned_cell_for(ith, &ref1, &ref2, &ref3);
         if (ref1 == cell) result = prepend_index(secd, ith, result);
@@ -856,12 +1416,37 @@ cell_t *secd_referers_for(secd_t *secd, cell_t *cell) {
     return result;
 }
 
+/* false if the list cannot grow */
+static bool push_gray(secd_t *secd, cell_t *cell) {
+    if (secd->ngray == secd->gray_size) {
+        size_t size = secd->gray_size;
+        size_t newsize = (size ? 2 * size : REMEMBERED_INITSIZE);
+        cell_t **newlist = realloc(secd->gray, newsize * sizeof(cell_t *));
+        if (!newlist)
+            return false;
+
+        secd->gray = newlist;
+        secd->gray_size = newsize;
+    }
+    secd->gray[secd->ngray++] = cell;
+    return true;
+}
+
+/* counts a reference, the cell is scanned when it is reached first */
 static void increment_nref_for_owned(secd_t *secd, cell_t *cell) {
-    if (is_nil(cell)) return;
+    if (!is_refcounted(cell)) return;
 
     ++cell->nref;
     if (cell->nref > 1) return;
 
+    if (!push_gray(secd, cell))
+        secd->gray_overflow = true;
+}
+
+/* counts the references of the cell */
+static void scan_owned(secd_t *secd, cell_t *cell) {
+    cell->flags |= FLAG_SCANNED;
+
     if (cell_type(cell) != CELL_ARRMETA) {
         cell_t *ref1, *ref2, *ref3;
         secd_owned_cell_for(cell, &ref1, &ref2, &ref3);
@@ -871,7 +1456,7 @@ static void increment_nref_for_owned(secd_t *secd, cell_t *cell) {
         return;
     }
 
-    if (cell->as.mcons.cells) {
+    if (arrmeta_has_cells(cell)) {
         size_t i;
         size_t len = arrmeta_size(secd, cell);
         for (i = 0; i < len; ++i)
@@ -879,42 +1464,389 @@ static void increment_nref_for_owned(secd_t *secd, cell_t *cell) {
     }
 }
 
+static void scan_gray(secd_t *secd) {
+    while (secd->ngray > 0)
+        scan_owned(secd, secd->gray[--secd->ngray]);
+}
+
+inline static void rescan_cell(secd_t *secd, cell_t *cell) {
+    if (cell->nref && !(cell->flags & FLAG_SCANNED)) {
+        scan_owned(secd, cell);
+        scan_gray(secd);
+    }
+}
+
+/* the gray list could not grow: finds counted cells that are not
+ * scanned yet by walking the heap */
+static void rescan_counted(secd_t *secd) {
+    while (secd->gray_overflow) {
+        secd->gray_overflow = false;
+
+        cell_t *cell;
+        for (cell = secd->nurseryend; cell < secd->fixedptr; ++cell)
+            rescan_cell(secd, cell);
+
+        cell_t *meta;
+        for (meta = mcons_next(secd->arrlist); not_nil(meta); meta = mcons_next(meta)) {
+            if (is_array_free(secd, meta))
+                continue;
+            rescan_cell(secd, meta);
+            if (arrmeta_has_cells(meta)) {
+                size_t i;
+                size_t len = arrmeta_size(secd, meta);
+                for (i = 0; i < len; ++i)
+                    rescan_cell(secd, meta_mem(meta) + i);
+            }
+        }
+    }
+}
+
+static unsigned long usec_since(const struct timespec *then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000000ul
+         + (now.tv_nsec - then->tv_nsec) / 1000;
+}
+
+void remember_cell(secd_t *secd, cell_t *cell) {
+    if (cell->flags & FLAG_REMEMBERED)
+        return;
+
+    if (secd->nremembered == secd->remembered_size) {
+        size_t size = secd->remembered_size;
+        size_t newsize = (size ? 2 * size : REMEMBERED_INITSIZE);
+        cell_t **newset = realloc(secd->remembered, newsize * sizeof(cell_t *));
+        if (!newset) {
+            /* the next secd_minor_gc() walks all old cells instead */
+            if (!secd->remembered_overflow)
+                errorf("remember_cell: no memory for the remembered set\n");
+            secd->remembered_overflow = true;
+            return;
+        }
+
+        secd->remembered = newset;
+        secd->remembered_size = newsize;
+    }
+    cell->flags |= FLAG_REMEMBERED;
+    secd->remembered[secd->nremembered++] = share_cell(secd, cell);
+}
+
+void remember_item(secd_t *secd, const cell_t *arr, cell_t *item) {
+    cellref_t *slots[2];
+    int i, n = young_ref_slots(item, slots);
+    for (i = 0; i < n; ++i)
+        if (is_young(secd, ref_cell(*slots[i]))) {
+            remember_cell(secd, (cell_t *)arr_val(arr, -1));
+            return;
+        }
+}
+
+void defer_free(secd_t *secd, cell_t *c) {
+    if (secd->nzct == secd->zct_size) {
+        size_t size = secd->zct_size;
+        size_t newsize = (size ? 2 * size : ZCT_INITSIZE);
+        cell_t **newzct = realloc(secd->zct, newsize * sizeof(cell_t *));
+        if (!newzct) {
+            /* the cell is left for mark & sweep */
+            errorf("defer_free: no memory for the zero count table\n");
+            return;
+        }
+        secd->zct = newzct;
+        secd->zct_size = newsize;
+    }
+    secd->zct[secd->nzct++] = c;
+    if ((secd->nzct >= secd->zct_limit) && (secd->postop == SECD_NOPOST))
+        secd->postop = SECDPOST_MINORGC;
+}
+
+/* calls `count` for every reference of the registers, the stack and the dump */
+static void count_registers(secd_t *secd, void (*count)(secd_t *, cell_t *)) {
+    cell_t **val;
+    for (val = secd->stack; val < secd->stackptr; ++val)
+        count(secd, *val);
+    count(secd, secd->control);
+    count(secd, secd->env);
+
+    callframe_t *frame;
+    for (frame = secd->dump; frame < secd->dumpptr; ++frame) {
+        count(secd, frame->control);
+        count(secd, frame->env);
+    }
+}
+
+static void share_register(secd_t *secd, cell_t *cell) {
+    share_cell(secd, cell);
+}
+
+static void drop_register(secd_t *secd, cell_t *cell) {
+    drop_cell(secd, cell);
+}
+
+/* frees the cells of the table that the registers do not refer to,
+ * the rest stays there; only between instructions */
+static void secd_reconcile(secd_t *secd) {
+    count_registers(secd, share_register);
+
+    size_t i;
+    for (i = 0; i < secd->nzct; ++i) {
+        /* freeing may add more cells to the table */
+        cell_t *cell = secd->zct[i];
+        if (cell >= secd->fixedptr)
+            continue;   /* given back to the free space already */
+        if ((cell_type(cell) != CELL_FREE) && (cell->nref == 0))
+            free_cell(secd, cell);
+    }
+    secd->nzct = 0;
+
+    count_registers(secd, drop_register);
+    secd->zct_limit = (2 * secd->nzct > ZCT_INITSIZE ? 2 * secd->nzct : ZCT_INITSIZE);
+}
+
+
+/* the old copy of a live young cell, counted if the reference shares it */
+static cell_t *forward(secd_t *secd, cell_t *cell, bool shares) {
+    if (!is_young(secd, cell))
+        return cell;
+
+    cell_t *copy;
+    if (cell->flags & FLAG_FORWARDED) {
+        copy = get_ref(cell);
+    } else {
+        copy = pop_old(secd);
+        *copy = *cell;
+        copy->nref = 0;
+        if (!push_gray(secd, copy))
+            errorf("secd_minor_gc: no memory to scan promoted cells\n");
+
+        cell->flags |= FLAG_FORWARDED;
+        cell->as.ref = cell_ref(copy);
+    }
+    if (shares)
+        ++copy->nref;
+    return copy;
+}
+
+static void forward_refs(secd_t *secd, cell_t *cell) {
+    cellref_t *slots[2];
+    int i, n = young_ref_slots(cell, slots);
+    for (i = 0; i < n; ++i) {
+        cell_t *ref = ref_cell(*slots[i]);
+        if (is_young(secd, ref))
+            *slots[i] = cell_ref(forward(secd, ref, true));
+    }
+}
+
+/* the remembered set could not grow: forwards references of every old
+ * cell instead, cells promoted meanwhile are scanned later anyway */
+static void forward_old(secd_t *secd) {
+    secd->remembered_overflow = false;
+
+    cell_t *cell;
+    for (cell = secd->nurseryend; cell < secd->fixedptr; ++cell)
+        if (cell_type(cell) != CELL_FREE)
+            forward_refs(secd, cell);
+
+    cell_t *meta;
+    for (meta = mcons_next(secd->arrlist); not_nil(meta); meta = mcons_next(meta)) {
+        if (is_array_free(secd, meta) || !arrmeta_has_cells(meta))
+            continue;
+        size_t i, len = arrmeta_size(secd, meta);
+        for (i = 0; i < len; ++i)
+            forward_refs(secd, meta_mem(meta) + i);
+    }
+}
+
+/* young cells are reachable from the roots, from remembered cells and
+ * from promoted cells; their copies are counted the same way as by
+ * secd_mark_and_sweep_gc(), the dead ones drop what they share */
+void secd_minor_gc(secd_t *secd) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    cell_t *young = secd->nurseryptr;
+    secd->nurseryptr = secd->nurserylimit;  // allocate old cells meanwhile
+
+    /* the promoted cells take the room heap_reserve() keeps for them */
+    size_t room = (secd->fixedlimit - secd->fixedptr) + secd->free_cells;
+    size_t nyoung = young - secd->begin;
+    if (room < nyoung)
+        grow_heap(secd, false, nyoung - room, 0, 0);
+
+    cell_t **val;
+    for (val = secd->stack; val < secd->stackptr; ++val)
+        *val = forward(secd, *val, false);
+    secd->control = forward(secd, secd->control, false);
+    secd->env = forward(secd, secd->env, false);
+
+    callframe_t *frame;
+    for (frame = secd->dump; frame < secd->dumpptr; ++frame) {
+        frame->control = forward(secd, frame->control, false);
+        frame->env = forward(secd, frame->env, false);
+        frame->input_port = forward(secd, frame->input_port, false);
+        frame->output_port = forward(secd, frame->output_port, false);
+    }
+
+    secd->debug_port = forward(secd, secd->debug_port, true);
+    secd->default_io = forward(secd, secd->default_io, true);
+    enum cell_type t;
+    for (t = 0; t <= CELL_ERROR; ++t)
+        secd->type_syms[t] = forward(secd, secd->type_syms[t], true);
+
+    secd->global_env = forward(secd, secd->global_env, false);
+    secd->input_port = forward(secd, secd->input_port, false);
+    secd->output_port = forward(secd, secd->output_port, false);
+
+    if (secd->remembered_overflow)
+        forward_old(secd);
+
+    size_t i;
+    for (i = 0; i < secd->nremembered; ++i) {
+        cell_t *cell = secd->remembered[i];
+        cell->flags &= ~FLAG_REMEMBERED;
+        if (cell_type(cell) != CELL_ARRMETA) {
+            forward_refs(secd, cell);
+        } else if (arrmeta_has_cells(cell)) {
+            size_t j, len = arrmeta_size(secd, cell);
+            for (j = 0; j < len; ++j)
+                forward_refs(secd, meta_mem(cell) + j);
+        }
+    }
+
+    while (secd->ngray > 0)
+        forward_refs(secd, secd->gray[--secd->ngray]);
+
+    /* no old cell refers to young ones now */
+    for (i = 0; i < secd->nremembered; ++i) {
+        cell_t *cell = secd->remembered[i];
+        if (cell_type(cell) == CELL_ARRMETA)
+            drop_array(secd, meta_mem(cell));
+        else
+            drop_cell(secd, cell);
+    }
+    secd->nremembered = 0;
+
+    cell_t *cell;
+    for (cell = secd->begin; cell < young; ++cell)
+        if (!(cell->flags & FLAG_FORWARDED)) {
+            ++secd->freed[cell_type(cell)];
+            drop_dependencies(secd, cell);
+        }
+
+    /* the next promotion must fit in the gap too: if the heap is full,
+     * it is narrower than the nursery and the nursery shrinks */
+    size_t gap = secd->arraylimit - secd->fixedlimit;
+    secd->nurseryptr = secd->begin;
+    secd->nurserylimit = (gap < (size_t)(secd->nurseryend - secd->begin)
+                          ? secd->begin + gap : secd->nurseryend);
+    ++secd->minor_gcs;
+
+    secd_reconcile(secd);
+    secd->minor_usec += usec_since(&start);
+}
+
+void secd_run_postop(secd_t *secd) {
+    /* collections may ask for more */
+    secdpostop_t postop = secd->postop;
+    secd->postop = SECD_NOPOST;
+
+    switch (postop) {
+      case SECDPOST_GC:
+        secd_mark_and_sweep_gc(secd);
+        printf(";; gc: mark %lu us, sweep %lu us\n",
+                secd->mark_usec, secd->sweep_usec);
+        break;
+      case SECDPOST_AUTOGC:
+        secd_mark_and_sweep_gc(secd);
+        break;
+      case SECDPOST_MINORGC:
+        secd_minor_gc(secd);
+        break;
+      case SECDPOST_IMAGE:
+        secd_mark_and_sweep_gc(secd);
+        secd_write_image(secd);
+        break;
+      default: break;
+    }
+}
+
+/* the thresholds for check_heap_pressure() after a GC */
+static void gc_plan_next(secd_t *secd) {
+    size_t live = (secd->fixedptr - secd->nurseryend) - secd->free_cells;
+    size_t next = live * 100 / (100 - secd->gc_free_percent);
+    secd->gc_threshold = (next > secd->gc_min_cells ? next : secd->gc_min_cells);
+
+    /* if a GC does not make the gap wide enough, the next one waits
+     * till it is half as wide */
+    size_t gap = secd->arraylimit - secd->fixedptr;
+    if ((size_t)(secd->arrayptr - secd->fixedlimit) < gap)
+        gap = secd->arrayptr - secd->fixedlimit;
+    size_t limit = (secd->end - secd->begin) / 100 * secd->gc_gap_percent;
+    secd->gc_gap_limit = (gap / 2 < limit ? gap / 2 : limit);
+}
+
 void secd_mark_and_sweep_gc(secd_t *secd) {
     /* set all refcounts to zero */
     cell_t *cell;
     cell_t *meta;
 
-    for (cell = secd->begin; cell < secd->fixedptr; ++cell)
+    secd_minor_gc(secd);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (cell = secd->nurseryend; cell < secd->fixedptr; ++cell) {
         cell->nref = 0;
+        cell->flags &= ~FLAG_SCANNED;
+    }
 
     meta = mcons_next(secd->arrlist);
     while (not_nil(meta)) {
         meta->nref = 0;
-        if (meta->as.mcons.cells) {
+        meta->flags &= ~FLAG_SCANNED;
+        if (arrmeta_has_cells(meta)) {
             size_t i;
             size_t len = arrmeta_size(secd, meta);
-            for (i = 0; i < len; ++i)
+            for (i = 0; i < len; ++i) {
                 meta_mem(meta)[i].nref = 0;
+                meta_mem(meta)[i].flags &= ~FLAG_SCANNED;
+            }
         }
         meta = mcons_next(meta);
     }
 
     /* set new refcounts */
-    increment_nref_for_owned(secd, secd->stack);
-    increment_nref_for_owned(secd, secd->control);
-    increment_nref_for_owned(secd, secd->env);
-    increment_nref_for_owned(secd, secd->dump);
+    count_registers(secd, increment_nref_for_owned);
 
     increment_nref_for_owned(secd, secd->debug_port);
+    increment_nref_for_owned(secd, secd->default_io);
+
+    enum cell_type t;
+    for (t = 0; t <= CELL_ERROR; ++t)
+        increment_nref_for_owned(secd, secd->type_syms[t]);
+
+    size_t i;
+    for (i = 0; i < secd->symtab_size; ++i)
+        if (secd->symtab[i])
+            increment_nref_for_owned(secd, secd->symtab[i]->cell);
+
+    scan_gray(secd);
+    rescan_counted(secd);
+
+    secd->mark_usec = usec_since(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     /* make new secd->free_list, free unused arrays */
     secd->free = SECD_NIL;
     secd->free_cells = 0;
-    for (cell = secd->begin; cell < secd->fixedptr; ++cell) {
+    secd->io_frames = 0;
+    for (cell = secd->nurseryend; cell < secd->fixedptr; ++cell) {
+        if ((cell->type == CELL_FRAME) && (cell->flags & FLAG_FRAMEIO) && cell->nref)
+            ++secd->io_frames;
         if (cell->nref == 0) {
             if (cell_type(cell) != CELL_FREE) {
                 memdebugf(";; m&s: cell %ld collected\n",
                         cell_index(secd, cell));
+                ++secd->freed[cell_type(cell)];
             }
 
             push_free(secd, cell);
@@ -934,29 +1866,132 @@ void secd_mark_and_sweep_gc(secd_t *secd) {
         if (prevmeta != secd->arrlist)
             pprev = mcons_prev(prevmeta);
 
-        drop_dependencies(secd, meta);
+        /* the items are not counted as owners of anything,
+         * unreachable cells they refer to are already collected */
         /* here prevmeta may disappear: */
         free_array(secd, meta_mem(meta));
 
         prevmeta = pprev;
         meta = mcons_next(pprev);
     }
+
+    /* the used arrays may be scattered among free areas */
+    size_t arrcells = secd->arrlist - secd->arrayptr;
+    if (free_array_cells(secd) * 100 > arrcells * GC_COMPACT)
+        compact_arrays(secd);
+
+    /* the references of the registers are not counted */
+    secd->nzct = 0;
+    count_registers(secd, drop_register);
+
+    gc_plan_next(secd);
+    if (secd->postop != SECDPOST_GC)
+        secd->postop = SECD_NOPOST;    // this one has collected everything
+    secd->gc_emergency = false;
+
+    ++secd->major_gcs;
+    secd->sweep_usec = usec_since(&start);
+    secd->major_usec += secd->mark_usec + secd->sweep_usec;
 }
 
-void init_mem(secd_t *secd, cell_t *heap, size_t size) {
+void secd_set_gc_policy(secd_t *secd, size_t min_cells, int free_percent, int gap_percent) {
+    if (min_cells)
+        secd->gc_min_cells = min_cells;
+    if (free_percent)
+        secd->gc_free_percent = free_percent;
+    if (gap_percent)
+        secd->gc_gap_percent = gap_percent;
+    gc_plan_next(secd);
+}
+
+bool init_mem(secd_t *secd, size_t size, size_t maxsize) {
+    /* references of another heap would be decoded against this one */
+    if (secd_heap) {
+        errorf("init_mem: the process has a heap already\n");
+        return false;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (page_cells = 1; (page_cells * sizeof(cell_t)) % page; ++page_cells)
+        ;
+    maxsize = round_to_pages(maxsize);
+
+    /* every cell must be reachable by a cellref_t */
+    size_t reflimit = INT32_MAX / sizeof(cell_t) - 1;
+    if (maxsize > reflimit)
+        maxsize = reflimit / page_cells * page_cells;
+
+    /* the nursery goes first, old cells follow it: size is for them */
+    size_t nursery = NURSERY_CELLS;
+    if (nursery > maxsize / 4)
+        nursery = maxsize / 4;
+    nursery = round_to_pages(nursery);
+    if (size > maxsize - nursery)
+        size = maxsize - nursery;
+
+    cell_t *heap = mmap(NULL, maxsize * sizeof(cell_t), PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (heap == MAP_FAILED)
+        return false;
+
     secd->begin = heap;
-    secd->end = heap + size;
+    secd->end = heap + maxsize;
+    secd_heap = (char *)(heap - 1);
+    secd->fixedlimit = secd->begin;
+    secd->arraylimit = secd->end;
+
+    /* halves at a page, grow_heap() rounds up the rest */
+    size_t fixed = size / 2 / page_cells * page_cells;
+    if (!grow_heap(secd, false, nursery + fixed, 0, 0)
+        || !grow_heap(secd, true, size - fixed, 0, 0)) {
+        munmap(heap, maxsize * sizeof(cell_t));
+        secd_heap = NULL;
+        return false;
+    }
 
-    secd->fixedptr = secd->begin;
+    secd->nurseryptr = secd->begin;
+    secd->nurseryend = secd->nurserylimit = secd->begin + nursery;
+    secd->fixedptr = secd->nurseryend;
     secd->arrayptr = secd->end - 1;
+    secd->gc_emergency = false;
 
     secd->arrlist = secd->arrayptr;
     init_meta(secd, secd->arrlist, SECD_NIL, SECD_NIL);
     secd->arrlist->nref = DONT_FREE_THIS;
+    memset(secd->arrfree, 0, sizeof(secd->arrfree));
+    secd->arrfree_map = 0;
+
+    secd->stack = secd->stackbase = secd->stackptr = secd->stacklimit = NULL;
+    grow_stack(secd);
+
+    secd->dump = secd->dumpptr = secd->dumplimit = NULL;
+    grow_dump(secd);
+
+    secd->remembered = secd->gray = NULL;
+    secd->gray_overflow = false;
+    secd->nremembered = secd->remembered_size = 0;
+    secd->remembered_overflow = false;
+    secd->ngray = secd->gray_size = 0;
+    secd->zct = NULL;
+    secd->nzct = secd->zct_size = 0;
+    secd->symtab = NULL;
+    secd->nsyms = secd->symtab_size = 0;
+    secd->zct_limit = ZCT_INITSIZE;
+    secd->minor_gcs = secd->major_gcs = secd->emergency_gcs = 0;
+    secd->compactions = 0;
+    secd->minor_usec = secd->major_usec = 0;
+    secd->mark_usec = secd->sweep_usec = 0;
+    secd->gc_min_cells = GC_CELLS;
+    secd->gc_free_percent = GC_FREE;
+    secd->gc_gap_percent = GC_GAP;
 
     secd->used_stack = 0;
     secd->used_dump = 0;
     secd->used_control = 0;
     secd->free_cells = 0;
+    memset(secd->freed, 0, sizeof(secd->freed));
+
+    gc_plan_next(secd);
+    return true;
 }
 
@@ -19,7 +19,7 @@ cell_t *new_array_for(secd_t *secd, cell_t *mem);
 
 cell_t *new_string(secd_t *secd, const char *str);
 cell_t *new_string_of_size(secd_t *secd, size_t size);
-cell_t *new_strref(secd_t *secd, cell_t *mem, size_t size);
+cell_t *new_strref(secd_t *secd, cell_t *mem);
 
 cell_t *new_bytevector_of_size(secd_t *secd, size_t size);
 
@@ -41,21 +41,43 @@ cell_t *drop_dependencies(secd_t *secd, cell_t *c);
 
 cell_t *free_cell(secd_t *, cell_t *c);
 
-cell_t *push_stack(secd_t *secd, cell_t *newc);
-cell_t *pop_stack(secd_t *secd);
-
 cell_t *set_control(secd_t *secd, cell_t **opcons);
-cell_t *pop_control(secd_t *secd);
 
-cell_t *push_dump(secd_t *secd, cell_t *cell);
-cell_t *pop_dump(secd_t *secd);
+/*
+ * Young cells
+ */
+
+/* allocated in the nursery, not reference-counted */
+inline static bool is_young(secd_t *secd, const cell_t *c) {
+    return (c < secd->nurseryend) && (c >= secd->begin) && !is_immediate(c);
+}
+
+void remember_cell(secd_t *secd, cell_t *cell);
+
+/* an old fixed cell refers to val, see also remember_item() */
+inline static void write_barrier(secd_t *secd, cell_t *cell, const cell_t *val) {
+    if (is_young(secd, val) && (secd->nurseryend <= cell) && (cell < secd->fixedptr))
+        remember_cell(secd, cell);
+}
+
+inline static void set_car(secd_t *secd, cell_t *cons, cell_t *car) {
+    cons->as.cons.car = cell_ref(car);
+    write_barrier(secd, cons, car);
+}
+inline static void set_cdr(secd_t *secd, cell_t *cons, cell_t *cdr) {
+    cons->as.cons.cdr = cell_ref(cdr);
+    write_barrier(secd, cons, cdr);
+}
 
 /*
  * Reference-counting
  */
 
-inline static cell_t *share_cell(secd_t __unused *secd, cell_t *c) {
-    if (not_nil(c)) {
+/* the count is zero, but the machine registers may refer to the cell */
+void defer_free(secd_t *secd, cell_t *c);
+
+inline static cell_t *share_cell(secd_t *secd, cell_t *c) {
+    if (is_refcounted(c) && !is_young(secd, c)) {
         ++c->nref;
         memtracef("share[%ld] %ld\n", cell_index(c), c->nref);
     } else {
@@ -65,10 +87,12 @@ inline static cell_t *share_cell(secd_t __unused *secd, cell_t *c) {
 }
 
 inline static cell_t *drop_cell(secd_t *secd, cell_t *c) {
-    if (is_nil(c)) {
+    if (!is_refcounted(c)) {
         memtracef("drop [NIL]\n");
         return NULL;
     }
+    if (is_young(secd, c))
+        return c;
     if (c->nref <= 0) {
         errorf("%lu | drop_cell[%ld]: negative", secd->tick, cell_index(secd, c));
         return new_error(secd, "drop_cell[%ld]: c->nref=%d",
@@ -77,15 +101,83 @@ inline static cell_t *drop_cell(secd_t *secd, cell_t *c) {
 
     -- c->nref;
     memtracef("drop [%ld] %ld\n", cell_index(c), c->nref);
-    if (c->nref) return c;
-    return free_cell(secd, c);
+    if (c->nref == 0)
+        defer_free(secd, c);
+    return c;
 }
 
-inline static cell_t *assign_cell(secd_t *secd, cell_t **cell, cell_t *what) {
-    cell_t *oldval = *cell;
-    *cell = share_cell(secd, what);
+/* replaces a reference inside the heap, see write_barrier() */
+inline static cell_t *assign_ref(secd_t *secd, cellref_t *ref, cell_t *what) {
+    cell_t *oldval = ref_cell(*ref);
+    *ref = cell_ref(share_cell(secd, what));
     drop_cell(secd, oldval);
-    return *cell;
+    return what;
+}
+
+/*
+ *    The value stack
+ *  values on the stack, in S, E, C and on the dump are not counted:
+ *  cells of zero count wait in a table till secd_reconcile()
+ */
+
+cell_t *grow_stack(secd_t *secd);
+
+inline static cell_t *push_stack(secd_t *secd, cell_t *newc) {
+    if (secd->stackptr == secd->stacklimit) {
+        cell_t *err = grow_stack(secd);
+        if (is_error(err)) return err;
+    }
+    *secd->stackptr++ = newc;
+    if ((size_t)(secd->stackptr - secd->stack) > secd->used_stack)
+        secd->used_stack = secd->stackptr - secd->stack;
+    return newc;
+}
+
+inline static cell_t *pop_stack(secd_t *secd) {
+    if (secd->stackptr == secd->stackbase)
+        return new_error(secd, "pop: stack is empty");
+    return *--secd->stackptr;
+}
+
+/* number of values of the current function */
+inline static size_t stack_depth(secd_t *secd) {
+    return secd->stackptr - secd->stackbase;
+}
+
+/* drops all values of the current function */
+inline static void clear_stack(secd_t *secd) {
+    secd->stackptr = secd->stackbase;
+}
+
+/* a new list of the current function values, the top first */
+cell_t *stack_list(secd_t *secd);
+
+/*
+ *    The dump
+ */
+
+cell_t *grow_dump(secd_t *secd);
+
+/* a new frame on the dump, its fields are not initialized */
+inline static callframe_t *push_dump(secd_t *secd) {
+    if (secd->dumpptr == secd->dumplimit) {
+        if (is_error(grow_dump(secd)))
+            return NULL;
+    }
+    if ((size_t)(secd->dumpptr - secd->dump) >= secd->used_dump)
+        secd->used_dump = secd->dumpptr - secd->dump + 1;
+    return secd->dumpptr++;
+}
+
+/* the frame is valid until the next push_dump() */
+inline static callframe_t *pop_dump(secd_t *secd) {
+    if (secd->dumpptr == secd->dump)
+        return NULL;
+    return --secd->dumpptr;
+}
+
+inline static size_t dump_depth(secd_t *secd) {
+    return secd->dumpptr - secd->dump;
 }
 
 cell_t *secd_referers_for(secd_t *secd, cell_t *cell);
@@ -97,7 +189,7 @@ void secd_owned_cell_for(cell_t *cell, cell_t **ref1, cell_t **ref2, cell_t **re
 static inline size_t arrmeta_size(secd_t *secd, const cell_t *metacons) {
     asserti(cell_type(metacons) == CELL_ARRMETA, "arrmeta_size: not a meta");
     if (metacons == secd->arrlist) return 0;
-    return metacons->as.mcons.prev - metacons - 1;
+    return mcons_prev(metacons) - metacons - 1;
 }
 
 static inline cell_t *arr_meta(cell_t *mem) {
@@ -114,25 +206,31 @@ static inline cell_t *meta_mem(cell_t *meta) {
 
 static inline const cell_t *
 arr_val(const cell_t *arr, size_t index) {
-    return arr->as.arr.data + index;
+    return ref_cell(arr->as.arr.data) + index;
 }
 
 static inline cell_t *arr_mem(const cell_t *arr) {
-    return arr->as.arr.data;
+    return ref_cell(arr->as.arr.data);
 }
 
 static inline size_t arr_size(secd_t *secd, const cell_t *arr) {
     return arrmeta_size(secd, arr_val(arr, -1));
 }
 
+/* in bytes, the last cell of the memory may be padded */
 static inline size_t mem_size(const cell_t *str) {
-    return str->as.str.size;
+    const cell_t *meta = arr_val(str, -1);
+    size_t pad = (meta->flags & FLAG_ARRPAD) >> FLAG_ARRPAD_SHIFT;
+    return (mcons_prev(meta) - meta - 1) * sizeof(cell_t) - pad;
 }
 
 static inline cell_t *arr_ref(cell_t *arr, size_t index) {
     return arr_mem(arr) + index;
 }
 
+/* the same as write_barrier() for an item of the array */
+void remember_item(secd_t *secd, const cell_t *arr, cell_t *item);
+
 cell_t *fill_array(secd_t *secd, cell_t *arr, cell_t *with);
 
 
@@ -142,7 +240,39 @@ cell_t *fill_array(secd_t *secd, cell_t *arr, cell_t *with);
 
 void secd_mark_and_sweep_gc(secd_t *secd);
 
-void init_mem(secd_t *secd, cell_t *heap, size_t size);
+/* promotes live young cells, frees the rest; only between instructions */
+void secd_minor_gc(secd_t *secd);
+
+/* what the heap holds now, see secd_stats() */
+typedef struct {
+    size_t live[CELL_ERROR + 1];    // cells not freed yet, by type
+    size_t array_used;      // cells of arrays in use
+    size_t array_free;      // cells of free areas between them
+    size_t array_holes;     // free areas
+    size_t array_largest;   // cells of the largest free area
+} heap_census_t;
+
+void secd_heap_census(secd_t *secd, heap_census_t *census);
+
+/* does what secd->postop asks for */
+void secd_run_postop(secd_t *secd);
+
+/* sets the thresholds of automatic GCs, zero keeps a value */
+void secd_set_gc_policy(secd_t *secd, size_t min_cells, int free_percent, int gap_percent);
+
+/* reserves maxsize cells for the heap, commits size of them */
+bool init_mem(secd_t *secd, size_t size, size_t maxsize);
+
+/*
+ *    Images, see image.c
+ */
+
+/* commits at least `fixed` cells from secd->begin
+ * and `arrays` cells up to secd->end */
+bool commit_heap(secd_t *secd, size_t fixed, size_t arrays);
+
+/* interns the name with an existing cell */
+cell_t *intern_symbol_at(secd_t *secd, cell_t *cell, const char *name);
 
 /*
  *    UTF-8
@@ -2,7 +2,9 @@
 #include "secd_io.h"
 #include "memory.h"
 #include "env.h"
+#include "secdops.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -204,7 +206,7 @@ static cell_t *list_copy(secd_t *secd, cell_t *list, cell_t **out_tail) {
 
     while (not_nil(list = list_next(secd, list))) {
         cell_t *new_cell = new_cons(secd, get_car(list), SECD_NIL);
-        new_tail->as.cons.cdr = share_cell(secd, new_cell);
+        set_cdr(secd, new_tail, share_cell(secd, new_cell));
         new_tail = list_next(secd, new_tail);
     }
     if (out_tail)
@@ -234,8 +236,8 @@ cell_t *secdf_append(secd_t *secd, cell_t *args) {
     cell_t *sum = xs;
     cell_t *sum_tail = xs;
     while (true) {
-        if (sum_tail->nref > 1) {
-            sum_tail = NULL; // xs must be copied
+        if (is_young(secd, sum_tail) || sum_tail->nref > 1) {
+            sum_tail = NULL; // xs must be copied, young cells are not counted
             break;
         }
         if (is_nil(list_next(secd, sum_tail)))
@@ -245,13 +247,13 @@ cell_t *secdf_append(secd_t *secd, cell_t *args) {
 
     if (sum_tail) {
         ctrldebugf("secdf_append: destructive append\n");
-        sum_tail->as.cons.cdr = share_cell(secd, ys);
+        set_cdr(secd, sum_tail, share_cell(secd, ys));
         sum = xs;
     } else {
         ctrldebugf("secdf_append: copying append\n");
         cell_t *sum_tail;
         sum = list_copy(secd, xs, &sum_tail);
-        sum_tail->as.cons.cdr = share_cell(secd, ys);
+        set_cdr(secd, sum_tail, share_cell(secd, ys));
     }
 
     return sum;
@@ -288,7 +290,7 @@ cell_t *secdf_defp(secd_t *secd, cell_t *args) {
 
     cell_t *sym = list_head(args);
     assert(is_symbol(sym), "secdf_deps: not a symbol");
-    return to_bool(secd, not_nil(lookup_symenv(secd, symname(sym))));
+    return to_bool(secd, not_nil(lookup_symenv(secd, sym)));
 }
 
 cell_t *secdf_hash(secd_t *secd, cell_t *args) {
@@ -301,6 +303,77 @@ cell_t *secdf_hash(secd_t *secd, cell_t *args) {
     return SECD_NIL;
 }
 
+/*
+ *  Opcode pairs statistics
+ */
+#define OPSTATS_TOP     16
+
+typedef struct {
+    unsigned long count;
+    opindex_t first;
+    opindex_t second;
+} oppair_t;
+
+static int oppair_cmp(const void *a, const void *b) {
+    unsigned long ca = ((const oppair_t *)a)->count;
+    unsigned long cb = ((const oppair_t *)b)->count;
+    return (ca < cb) - (ca > cb);   // most frequent first
+}
+
+/* starts counting, returns the most frequent pairs if counting */
+static cell_t *secd_opstats(secd_t *secd, cell_t *args) {
+    cell_t *opt = (not_nil(args) ? get_car(args) : SECD_NIL);
+    if (is_symbol(opt) && str_eq(symname(opt), "off")) {
+        free(secd->opstats);
+        secd->opstats = NULL;
+        return new_symbol(secd, "ok");
+    }
+
+    if (!secd->opstats) {
+        secd->opstats = calloc(SECD_LAST * SECD_LAST, sizeof(unsigned long));
+        assert(secd->opstats, "secd_opstats: no memory");
+        secd->lastop = SECD_LAST;
+        printf(";; counting pairs of opcodes, (secd 'opstats 'off) stops it\n");
+        return new_symbol(secd, "ok");
+    }
+
+    oppair_t *pairs = malloc(SECD_LAST * SECD_LAST * sizeof(oppair_t));
+    assert(pairs, "secd_opstats: no memory");
+
+    size_t npairs = 0;
+    int i, j;
+    for (i = 0; i < SECD_LAST; ++i)
+        for (j = 0; j < SECD_LAST; ++j) {
+            unsigned long count = secd->opstats[ i * SECD_LAST + j ];
+            if (count == 0)
+                continue;
+            pairs[npairs].count = count;
+            pairs[npairs].first = i;
+            pairs[npairs].second = j;
+            ++npairs;
+        }
+    qsort(pairs, npairs, sizeof(oppair_t), oppair_cmp);
+    if (npairs > OPSTATS_TOP)
+        npairs = OPSTATS_TOP;
+
+    size_t k;
+    for (k = 0; k < npairs; ++k)
+        printf(";;  %-8s %-8s %lu\n", opcode_table[ pairs[k].first ].name,
+                opcode_table[ pairs[k].second ].name, pairs[k].count);
+
+    /* a list of (OP1 OP2 count) */
+    cell_t *res = SECD_NIL;
+    while (npairs-- > 0) {
+        oppair_t *p = pairs + npairs;
+        cell_t *cnt = new_cons(secd, new_number(secd, p->count), SECD_NIL);
+        cell_t *snd = new_cons(secd, new_symbol(secd, opcode_table[p->second].name), cnt);
+        cell_t *fst = new_cons(secd, new_symbol(secd, opcode_table[p->first].name), snd);
+        res = new_cons(secd, fst, res);
+    }
+    free(pairs);
+    return res;
+}
+
 cell_t *secdf_ctl(secd_t *secd, cell_t *args) {
     ctrldebugf("secdf_ctl\n");
     if (is_nil(args))
@@ -310,6 +383,17 @@ cell_t *secdf_ctl(secd_t *secd, cell_t *args) {
     if (is_symbol(arg1)) {
         if (str_eq(symname(arg1), "mem")) {
             printf(";;  size = %zd\n", secd->end - secd->begin);
+            printf(";;  committed = %zd\n", (secd->fixedlimit - secd->begin)
+                                          + (secd->end - secd->arraylimit));
+            printf(";;  nursery = %zd of %zd, %zd minor GCs in %lu us\n",
+                    secd->nurseryptr - secd->begin,
+                    secd->nurseryend - secd->begin,
+                    secd->minor_gcs, secd->minor_usec);
+            printf(";;  %zd mark & sweep GCs (%zd emergency) in %lu us\n",
+                    secd->major_gcs, secd->emergency_gcs, secd->major_usec);
+            printf(";;  %zd compactions of arrays\n", secd->compactions);
+            printf(";;  the next at %zd old cells or %zd unused cells\n",
+                    secd->gc_threshold, secd->gc_gap_limit);
             printf(";;  fixedptr = %zd\n", secd->fixedptr - secd->begin);
             printf(";;  arrayptr = %zd (%zd)\n",
                     secd->arrayptr - secd->begin, secd->arrayptr - secd->end);
@@ -318,17 +402,14 @@ cell_t *secdf_ctl(secd_t *secd, cell_t *args) {
         } else if (str_eq(symname(arg1), "env")) {
             print_env(secd);
         } else if (str_eq(symname(arg1), "dump")) {
+            /* a list of (control ip env) for every frame, the top first */
             cell_t *dlist = SECD_NIL;
-            cell_t *lstcur = SECD_NIL;
-            cell_t *dmpcur;
-            for (dmpcur = secd->dump; not_nil(dmpcur); dmpcur = list_next(secd, dmpcur)) {
-                cell_t *cns = new_cons(secd, new_number(secd, cell_index(secd, dmpcur)), SECD_NIL);
-                if (not_nil(dlist)) {
-                    lstcur->as.cons.cdr = share_cell(secd, cns);
-                    lstcur = cns;
-                } else {
-                    dlist = lstcur = cns;
-                }
+            callframe_t *frame;
+            for (frame = secd->dump; frame < secd->dumpptr; ++frame) {
+                cell_t *envc = new_cons(secd, new_number(secd, cell_index(secd, frame->env)), SECD_NIL);
+                cell_t *ipc = new_cons(secd, new_number(secd, frame->ipoffset), envc);
+                cell_t *ctrlc = new_cons(secd, new_number(secd, cell_index(secd, frame->control)), ipc);
+                dlist = new_cons(secd, ctrlc, dlist);
             }
             return dlist;
         } else if (str_eq(symname(arg1), "cell")) {
@@ -341,7 +422,9 @@ cell_t *secdf_ctl(secd_t *secd, cell_t *args) {
             }
             int num = numval(numc);
             cell_t *c = secd->begin + num;
-            if (c >= secd->end) {
+            if ((num < 0) || (c >= secd->end)
+                || ((secd->nurseryptr <= c) && (c < secd->nurseryend))
+                || ((secd->fixedptr <= c) && (c < secd->arrayptr))) {
                 printf(";; cell number is out of SECD heap\n");
                 return SECD_NIL;
             }
@@ -358,16 +441,31 @@ cell_t *secdf_ctl(secd_t *secd, cell_t *args) {
             print_array_layout(secd);
         } else if (str_eq(symname(arg1), "gc")) {
             secd->postop = SECDPOST_GC;
+        } else if (str_eq(symname(arg1), "save-image")) {
+            if (is_nil(list_next(secd, args)))
+                goto help;
+            cell_t *path = get_car(list_next(secd, args));
+            if (cell_type(path) != CELL_STR) {
+                printf(";; the path of an image must be a string\n");
+                return SECD_NIL;
+            }
+            return secd_save_image(secd, strval(path));
+        } else if (str_eq(symname(arg1), "opstats")) {
+            return secd_opstats(secd, list_next(secd, args));
+        } else if (str_eq(symname(arg1), "stats")) {
+            return secd_stats(secd);
         } else if (str_eq(symname(arg1), "tick")) {
             printf(";; tick = %lu\n", secd->tick);
             return new_number(secd, secd->tick);
         } else if (str_eq(symname(arg1), "state")) {
-            printf(";; stack = %ld\n", cell_index(secd, secd->stack));
+            cell_t *stack = stack_list(secd);
+            printf(";; stack = ");
+            sexp_print(secd, stack); printf("\n");
+            if (not_nil(stack))
+                free_cell(secd, stack);
             printf(";; env   = %ld\n", cell_index(secd, secd->env));
             printf(";; ctrl  = %ld\n", cell_index(secd, secd->control));
-            printf(";; dump  = %ld\n\n", cell_index(secd, secd->dump));
-            printf(";; %s = %ld\n",   SECD_TRUE,  cell_index(secd, secd->truth_value));
-            printf(";; %s = %ld\n\n", SECD_FALSE, cell_index(secd, secd->false_value));
+            printf(";; dump  = %zd frames\n\n", dump_depth(secd));
             printf(";; *stdin*  = %ld\n", cell_index(secd, secd->input_port));
             printf(";; *stdout* = %ld\n", cell_index(secd, secd->output_port));
             printf(";; *stddbg* = %ld\n\n", cell_index(secd, secd->debug_port));
@@ -378,8 +476,9 @@ cell_t *secdf_ctl(secd_t *secd, cell_t *args) {
     return new_symbol(secd, "ok");
 help:
     errorf(";; Options are 'env, 'mem, 'heap,\n");
-    errorf(";;    'tick, 'dump, 'state, 'gc, \n");
-    errorf(";;    'where <smth>, 'cell <num>, 'owner <num>\n");
+    errorf(";;    'tick, 'dump, 'state, 'gc, 'opstats, 'stats,\n");
+    errorf(";;    'where <smth>, 'cell <num>, 'owner <num>,\n");
+    errorf(";;    'save-image \"file\"\n");
     errorf(";; Use them like (secd 'env) or (secd 'cell 12)\n");
     errorf(";; If you're here first time, explore (secd 'env)\n");
     errorf(";;    to get some idea of what is available\n");
@@ -441,6 +540,7 @@ cell_t *secdv_make(secd_t *secd, cell_t *args) {
 
     size_t len = numval(num);
     cell_t *arr = new_array(secd, len);
+    assert_cell(arr, "secdv_make: failed to allocate");
 
     if (not_nil(list_next(secd, args))) {
         cell_t *fill = get_car(list_next(secd, args));
@@ -498,9 +598,10 @@ cell_t *secdv_set(secd_t *secd, cell_t *args) {
     assert(not_nil(args), "secdv_set: third argument expected");
 
     cell_t *obj = get_car(args);
-    cell_t *ref = arr->as.arr.data + ind;
+    cell_t *ref = arr_ref(arr, ind);
     drop_dependencies(secd, ref);
     init_with_copy(secd, ref, obj);
+    remember_item(secd, arr, ref);
 
     return arr;
 }
@@ -535,7 +636,7 @@ cell_t *secdf_strlen(secd_t *secd, cell_t *args) {
 
     cell_t *str = get_car(args);
     assert(cell_type(str) == CELL_STR, "not a string");
-    return new_number(secd, utf8strlen((const char *)str->as.str.data));
+    return new_number(secd, utf8strlen(strval(str)));
 }
 
 cell_t *secdf_strref(secd_t *secd, cell_t *args) {
@@ -574,7 +675,7 @@ cell_t *secdf_sym2str(secd_t *secd, cell_t *args) {
 
 static cell_t *string_to_list(secd_t *secd, const char *cstr) {
     cell_t *res = SECD_NIL;
-    cell_t *cur;
+    cell_t *cur = SECD_NIL;
 
     unichar_t codepoint;
     while (1) {
@@ -594,7 +695,7 @@ static cell_t *string_to_list(secd_t *secd, const char *cstr) {
         cell_t *nchr = new_char(secd, codepoint);
         cell_t *ncons = new_cons(secd, nchr, SECD_NIL);
         if (not_nil(res)) {
-            cur->as.cons.cdr = share_cell(secd, ncons);
+            set_cdr(secd, cur, share_cell(secd, ncons));
             cur = list_next(secd, cur);
         } else
             res = cur = ncons;
@@ -604,6 +705,7 @@ static cell_t *string_to_list(secd_t *secd, const char *cstr) {
 static cell_t *list_to_string(secd_t *secd, cell_t *lst) {
     size_t strsize = utf8list_len(secd, lst);
     cell_t *str = new_string_of_size(secd, strsize);
+    assert_cell(str, "list_to_string: failed to allocate");
     char *mem = strmem(str); // at least 1 byte
 
     while (not_nil(lst)) {
@@ -745,6 +847,7 @@ cell_t *secdf_bv2str(secd_t *secd, cell_t *args) {
     get_two_nums(secd, args, &start, &end, "bv2str");
 
     cell_t *str = new_string_of_size(secd, end - start);
+    assert_cell(str, "bv2str: failed to allocate");
     if (utf8memcpy(strmem(str), strval(bv) + start, end - start))
         return str;
 
@@ -765,6 +868,7 @@ cell_t *secdf_str2bv(secd_t *secd, cell_t *args) {
     const char *startmem = utf8nth(strval(str), start);
     size_t len = utf8memlen(startmem, end - start) + 1;
     cell_t *bv = new_bytevector_of_size(secd, len);
+    assert_cell(bv, "str2bv: failed to allocate");
 
     utf8memcpy(strmem(bv), startmem, len);
     return bv;
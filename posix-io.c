@@ -46,7 +46,7 @@ cell_t *secd_fopen(secd_t *secd, const char *fname, const char *mode) {
 long secd_portsize(secd_t __unused *secd, cell_t *port) {
     io_assert(cell_type(port) == CELL_PORT, "secd_portsize: not a port\n");
 
-    if (port->as.port.file) {
+    if (is_fileport(port)) {
         FILE *f = port->as.port.as.file;
         long curpos = ftell(f);
 
@@ -57,7 +57,7 @@ long secd_portsize(secd_t __unused *secd, cell_t *port) {
         fseek(f, curpos, SEEK_SET);
         return endpos;
     } else {
-        cell_t *str = port->as.port.as.str;
+        cell_t *str = port_str(port);
         return mem_size(str);
     }
 }
@@ -67,15 +67,14 @@ int secd_pclose(secd_t *secd, cell_t *port) {
     io_assert(!is_closed(port), "secd_pclose: already closed\n");
 
     int ret = 0;
-    if (port->as.port.file) {
+    if (is_fileport(port)) {
         ret = fclose(port->as.port.as.file);
         port->as.port.as.file = NULL;
     } else {
-        drop_cell(secd, port->as.port.as.str);
-        port->as.port.as.str = SECD_NIL;
+        drop_cell(secd, port_str(port));
+        port->as.port.as.str = cell_ref(SECD_NIL);
     }
-    port->as.port.input = false;
-    port->as.port.output = false;
+    port->flags &= ~(FLAG_PORTIN | FLAG_PORTOUT);
     return ret;
 }
 
@@ -87,15 +86,15 @@ int secd_getc(secd_t __unused *secd, cell_t *port) {
     io_assert(is_input(port), "secd_getc: not an input port\n");
     io_assert(!is_closed(port), "secd_getc: port is closed\n");
 
-    if (port->as.port.file) {
+    if (is_fileport(port)) {
         int c = fgetc(port->as.port.as.file);
         if (c != EOF)
             return c;
         return SECD_EOF;
     } else {
-        cell_t *str = port->as.port.as.str;
+        cell_t *str = port_str(port);
         size_t size = mem_size(str);
-        if (str->as.str.offset >= (int)size)
+        if (str->as.str.offset >= size)
             return EOF;
 
         char c = strmem(str)[str->as.str.offset];
@@ -109,11 +108,11 @@ size_t secd_fread(secd_t __unused *secd, cell_t *port, char *s, int size) {
     io_assert(is_input(port), "secd_fread: not an input port\n");
     io_assert(!is_closed(port), "secd_getc: port is closed\n");
 
-    if (port->as.port.file) {
+    if (is_fileport(port)) {
         FILE *f = port->as.port.as.file;
         return fread(s, size, 1, f);;
     } else {
-        cell_t *str = port->as.port.as.str;
+        cell_t *str = port_str(port);
         size_t srcsize = mem_size(str);
         if (srcsize < (size_t)size) size = srcsize;
 
@@ -132,10 +131,10 @@ int secd_vprintf(secd_t __unused *secd, cell_t *port, const char *format, va_lis
 
     int ret;
 
-    if (port->as.port.file) {
+    if (is_fileport(port)) {
         ret = vfprintf(port->as.port.as.file, format, ap);
     } else {
-        cell_t *str = port->as.port.as.str;
+        cell_t *str = port_str(port);
         char *mem = strmem(str);
         size_t offset = str->as.str.offset;
         size_t size = mem_size(str) - offset;
@@ -160,18 +159,18 @@ int secd_printf(secd_t *secd, cell_t *port, const char *format, ...) {
 }
 
 void sexp_print_port(secd_t *secd, const cell_t *port) {
-    if (SECD_NIL == port->as.port.as.str) {
+    if (is_closed(port)) {
         printf("#<closed>");
         return;
     }
-    bool in = port->as.port.input;
-    bool out = port->as.port.output;
+    bool in = is_input(port);
+    bool out = is_output(port);
     printf("#<%s%s%s: ", (in ? "input" : ""), (out ? "output" : ""), (in && out ? "/" : ""));
 
-    if (port->as.port.file) {
+    if (is_fileport(port)) {
         printf("file %d", fileno(port->as.port.as.file));
     } else {
-        printf("string %ld", cell_index(secd, port->as.port.as.str));
+        printf("string %ld", cell_index(secd, port_str(port)));
     }
     printf(">");
 }
@@ -23,10 +23,14 @@ void dbg_print_cell(secd_t *secd, const cell_t *c) {
          printf("NIL\n");
          return;
     }
-    char buf[128];
-    if (c->nref > DONT_FREE_THIS - 100000) strncpy(buf, "-", 64);
-    else snprintf(buf, 128, "%ld", (long)c->nref);
-    printf("[%ld]^%s: ", cell_index(secd, c), buf);
+    if (is_immediate(c)) {
+        printf("[imm]: ");
+    } else {
+        char buf[128];
+        if (c->nref > DONT_FREE_THIS - 100000) strncpy(buf, "-", 64);
+        else snprintf(buf, 128, "%ld", (long)c->nref);
+        printf("[%ld]^%s: ", cell_index(secd, c), buf);
+    }
 
     switch (cell_type(c)) {
       case CELL_CONS:
@@ -37,10 +41,10 @@ void dbg_print_cell(secd_t *secd, const cell_t *c) {
         printf("FRAME(syms: [%ld], vals: [%ld])\n",
                cell_index(secd, get_car(c)), cell_index(secd, get_cdr(c)));
         break;
-      case CELL_INT:  printf("%d", c->as.num); break;
+      case CELL_INT:  printf("%d", numval(c)); break;
       case CELL_CHAR:
-        if (isprint(c->as.num)) printf("#\\%c\n", (char)c->as.num);
-        else printf("#x%x\n", c->as.num);
+        if (isprint(numval(c))) printf("#\\%c\n", (char)numval(c));
+        else printf("#x%x\n", numval(c));
         break;
       case CELL_OP:   print_opcode(c->as.op); break;
       case CELL_FUNC: printf("*%p()\n", c->as.ptr); break;
@@ -51,7 +55,7 @@ void dbg_print_cell(secd_t *secd, const cell_t *c) {
       case CELL_SYM: printf("SYM[%08x]='%s'\n", symhash(c), symname(c)); break;
       case CELL_BYTES: printf("BVECT[%ld]\n",
                                cell_index(secd, (cell_t*)strval(c))); break;
-      case CELL_REF: printf("REF[%ld]\n", cell_index(secd, c->as.ref)); break;
+      case CELL_REF: printf("REF[%ld]\n", cell_index(secd, get_ref(c))); break;
       case CELL_ERROR: printf("ERR[%s]\n", errmsg(c)); break;
       case CELL_ARRMETA: printf("META[%ld, %ld]\n",
                                  cell_index(secd, mcons_prev((cell_t*)c)),
@@ -129,9 +133,9 @@ static void sexp_print_list(secd_t *secd, const cell_t *cell) {
 void sexp_print(secd_t* secd, const cell_t *cell) {
     switch (cell_type(cell)) {
       case CELL_UNDEF:  printf("#?"); break;
-      case CELL_INT:    printf("%d", cell->as.num); break;
+      case CELL_INT:    printf("%d", numval(cell)); break;
       case CELL_CHAR:
-        if (isprint(cell->as.num)) printf("#\\%c", (char)cell->as.num);
+        if (isprint(numval(cell))) printf("#\\%c", (char)numval(cell));
         else printf("#\\x%x", numval(cell));
         break;
       case CELL_OP:     print_opcode(cell->as.op); break;
@@ -144,6 +148,7 @@ void sexp_print(secd_t* secd, const cell_t *cell) {
       case CELL_BYTES:  sexp_print_bytes(secd, cell); break;
       case CELL_ERROR:  printf("#!\"%s\"", errmsg(cell)); break;
       case CELL_PORT:   sexp_print_port(secd, cell); break;
+      case CELL_REF:    sexp_print(secd, get_ref(cell)); break;
       default: errorf("sexp_print: unknown cell type %d", (int)cell_type(cell));
     }
 }
@@ -476,7 +481,7 @@ static cell_t *read_bytevector(secd_parser_t *p) {
 
         cell_t *newc = new_cons(secd, new_number(secd, p->numtok), SECD_NIL);
         if (not_nil(tmplist)) {
-            cur->as.cons.cdr = share_cell(secd, newc);
+            set_cdr(secd, cur, share_cell(secd, newc));
             cur = newc;
         } else {
             tmplist = cur = newc;
@@ -620,14 +625,14 @@ cell_t *read_list(secd_t *secd, secd_parser_t *p) {
 
                   if (is_nil(head)) /* Guile-like: (. val) returns val */
                       return val;
-                  tail->as.cons.cdr = share_cell(secd, val);
+                  set_cdr(secd, tail, share_cell(secd, val));
                   return head;
               }
         }
 
         newtail = new_cons(secd, val, SECD_NIL);
         if (not_nil(head)) {
-            tail->as.cons.cdr = share_cell(secd, newtail);
+            set_cdr(secd, tail, share_cell(secd, newtail));
             tail = newtail;
         } else {
             head = tail = newtail;
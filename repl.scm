@@ -263,15 +263,15 @@
         #t)
     ((eq? (secd-type obj) 'cons)
       (cond
-        ((secd-not (eq? (secd-type (car (cdr obj))) 'frame)) secd-false)
-        ((secd-not (eq? (secd-type (car(car(cdr(car obj))))) 'op)) secd-false)
+        ((secd-not (eq? (secd-type (car (cdr obj))) 'frame)) #f)
+        ((secd-not (eq? (secd-type (car (cdr (car obj)))) 'vect)) #f)
         (else
           (let ((args (car (car obj))))
             (cond
               ((null? args) #t)
-              ((secd-not (eq? (secd-type (car args)) 'sym)) secd-false)
+              ((secd-not (eq? (secd-type (car args)) 'sym)) #f)
               (else #t))))))
-    (else secd-false))))
+    (else #f))))
 (apply (lambda (command arglist) (secd-apply command arglist)))
 
 )
@@ -1,39 +1,190 @@
 #include "secd.h"
 #include "secd_io.h"
+#include "memory.h"
+
+#include <stdlib.h>
+#include <string.h>
 
 secd_t secd;
 
+/* "64M" and the like to a number of cells, 0 if invalid */
+static size_t parse_heap_size(const char *str) {
+    char *end;
+    unsigned long long bytes = strtoull(str, &end, 10);
+    switch (*end) {
+      case 'g': case 'G': bytes <<= 10; // fall through
+      case 'm': case 'M': bytes <<= 10; // fall through
+      case 'k': case 'K': bytes <<= 10; ++end; break;
+    }
+    if (*end != '\0')
+        return 0;
+    return bytes / sizeof(cell_t);
+}
+
+/* 1..99, 0 if invalid */
+static size_t parse_percent(const char *str) {
+    char *end;
+    unsigned long pc = strtoul(str, &end, 10);
+    if ((*end != '\0') || (pc >= 100))
+        return 0;
+    return pc;
+}
+
+/* secd_stats() as lines of a name and numbers */
+static void print_stats(secd_t *secd) {
+    cell_t *stats = share_cell(secd, secd_stats(secd));
+    cell_t *cur;
+    for (cur = stats; not_nil(cur); cur = list_next(secd, cur)) {
+        cell_t *entry = list_head(cur);
+        errorf("%s", symname(get_car(entry)));
+        cell_t *val = get_cdr(entry);
+        if (is_number(val)) {
+            errorf(" %d", numval(val));
+        } else {
+            for (; not_nil(val); val = list_next(secd, val))
+                errorf(" %d", numval(list_head(val)));
+        }
+        errorf("\n");
+    }
+    drop_cell(secd, stats);
+}
+
+static int usage(const char *name) {
+    errorf("usage: %s [--heap SIZE] [--max-heap SIZE] [--gc-min SIZE]\n", name);
+    errorf("          [--gc-free PERCENT] [--gc-gap PERCENT] [--stats]\n");
+    errorf("          [[--save-image FILE | --save-code FILE] file\n");
+    errorf("           | --image FILE | --builtin NAME]\n");
+    errorf("    SIZE is in bytes, may end with K, M or G\n");
+    errorf("    --image: resume a machine saved by (secd 'save-image \"FILE\"),\n");
+    errorf("        the heap keeps its size, --heap and --max-heap are not allowed\n");
+    errorf("    --save-image: save the machine about to run the file, do not run it\n");
+    errorf("    --save-code: write the compiled file as bytecode, do not run it\n");
+    errorf("    file: SECD code or bytecode (.secdb), the standard input by default\n");
+    errorf("    --builtin: run an image linked into the binary: scm2secd, repl,\n");
+    errorf("        the same as --image\n");
+    errorf("    --gc-min: old cells that are never collected automatically\n");
+    errorf("    --gc-free: the part of old cells that may be garbage at a GC\n");
+    errorf("    --gc-gap: collect when less of the heap is left unused\n");
+    errorf("    --stats: print (secd 'stats) to stderr on exit\n");
+    return 1;
+}
+
 int main(int argc, char *argv[]) {
+    size_t heapsize = 0, maxheapsize = 0;
+    size_t gcmin = 0, gcfree = 0, gcgap = 0;
+    const char *cmdfile = NULL;
+    const char *imagefile = NULL;
+    const char *saveimage = NULL;
+    const char *savecode = NULL;
+    const char *builtin = NULL;
+    bool stats = false;
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        size_t *opt = NULL;
+        size_t (*parse)(const char *) = parse_heap_size;
+        const char **path = NULL;
+        if (!strcmp(argv[i], "--image"))
+            path = &imagefile;
+        else if (!strcmp(argv[i], "--save-image"))
+            path = &saveimage;
+        else if (!strcmp(argv[i], "--save-code"))
+            path = &savecode;
+        else if (!strcmp(argv[i], "--builtin"))
+            path = &builtin;
+
+        if (path) {
+            if ((++i == argc) || *path)
+                return usage(argv[0]);
+            *path = argv[i];
+            continue;
+        } else if (!strcmp(argv[i], "--heap"))
+            opt = &heapsize;
+        else if (!strcmp(argv[i], "--max-heap"))
+            opt = &maxheapsize;
+        else if (!strcmp(argv[i], "--gc-min"))
+            opt = &gcmin;
+        else if (!strcmp(argv[i], "--gc-free")) {
+            opt = &gcfree; parse = parse_percent;
+        } else if (!strcmp(argv[i], "--gc-gap")) {
+            opt = &gcgap; parse = parse_percent;
+        } else if (!strcmp(argv[i], "--stats")) {
+            stats = true;
+            continue;
+        } else if ((argv[i][0] == '-') || cmdfile)
+            return usage(argv[0]);
+        else {
+            cmdfile = argv[i];
+            continue;
+        }
+
+        if ((++i == argc) || !(*opt = parse(argv[i])))
+            return usage(argv[0]);
+    }
+    if ((saveimage && savecode)
+        || (cmdfile || saveimage || savecode) + !!imagefile + !!builtin > 1)
+        return usage(argv[0]);
+    /* an image brings the heap it was saved with */
+    if ((imagefile || builtin) && (heapsize || maxheapsize))
+        return usage(argv[0]);
+
     errorf(";;;   Welcome to SECD   \n");
     errorf(";;;     sizeof(cell_t) is %zd\n", sizeof(cell_t));
     errorf(";;;     Type (secd) to get some help.\n");
 
-    init_secd(&secd);
+    if (imagefile || builtin) {
+        if (!(imagefile ? secd_load_image(&secd, imagefile)
+                        : secd_load_builtin(&secd, builtin)))
+            return 1;
+        secd_set_gc_policy(&secd, gcmin, gcfree, gcgap);
+        resume_secd(&secd);
+    } else {
+        if (!init_secd(&secd, heapsize, maxheapsize)) {
+            errorf("failed to reserve memory for the heap\n");
+            return 1;
+        }
+        secd_set_gc_policy(&secd, gcmin, gcfree, gcgap);
 #if ((CTRLDEBUG) || (MEMDEBUG))
-    secd_set_dbg(secd, secd_fopen(&secd, "secd.log", "w"));
+        secd_set_dbg(secd, secd_fopen(&secd, "secd.log", "w"));
 #endif
 
-    cell_t *cmdport = SECD_NIL;
-    if (argc == 2) {
-        cmdport = secd_fopen(&secd, argv[1], "r");
-    }
+        cell_t *inp;
+        if (cmdfile && is_code_file(cmdfile)) {
+            inp = secd_load_code(&secd, cmdfile);
+            if (is_error(inp)) {
+                errorf("%s: %s\n", cmdfile, errmsg(inp));
+                return 1;
+            }
+        } else {
+            cell_t *cmdport = SECD_NIL;
+            if (cmdfile) {
+                cmdport = secd_fopen(&secd, cmdfile, "r");
+            }
 
-    cell_t *inp = sexp_parse(&secd, cmdport); // cmdport is dropped after
+            inp = sexp_parse(&secd, cmdport); // cmdport is dropped after
 
-    if (is_nil(inp) || !is_cons(inp)) {
-        errorf("list of commands expected\n");
-        dbg_printc(&secd, inp);
-        return 1;
-    }
+            if (is_nil(inp) || !is_cons(inp)) {
+                errorf("list of commands expected\n");
+                dbg_printc(&secd, inp);
+                return 1;
+            }
+        }
 
-    run_secd(&secd, inp);
+        if (savecode)
+            return !secd_save_code(&secd, inp, savecode);
+        if (saveimage)
+            return !secd_save_start_image(&secd, inp, saveimage);
+        run_secd(&secd, inp);
+    }
 
     /* print the head of the stack */
-    if (not_nil(secd.stack)) {
+    if (stack_depth(&secd) > 0) {
         envdebugf("Stack head:\n");
-        dbg_printc(&secd, get_car(secd.stack));
+        dbg_printc(&secd, secd.stackptr[-1]);
     } else {
         envdebugf("Stack is empty\n");
     }
+    if (stats)
+        print_stats(&secd);
     return 0;
 }
@@ -45,6 +45,10 @@
 #define SECD_TRUE   "#t"
 
 typedef  uint32_t       hash_t;
+typedef  uint32_t       instr_t;
+
+/* cells refer to each other by 32-bit offsets in the heap, see ref_cell() */
+typedef  uint32_t       cellref_t;
 
 typedef  struct secd    secd_t;
 typedef  struct cell    cell_t;
@@ -52,18 +56,21 @@ typedef  struct cell    cell_t;
 typedef  struct cons  cons_t;
 typedef  struct symbol symbol_t;
 typedef  struct error error_t;
-typedef  struct frame frame_t;
 typedef  struct port  port_t;
 typedef  struct array array_t;
 typedef  struct string string_t;
+typedef  struct callframe callframe_t;
 
 /* machine operation set */
 typedef enum {
     SECD_ADD,   /* (a&int . b&int . s, e, ADD . c, d) -> (a+b . s, e, c, d) */
     SECD_AP,
+    SECD_CADDR, /* fused CDR CDR CAR */
+    SECD_CADR,  /* fused CDR CAR */
     SECD_CAR,
     SECD_CDR,
     SECD_CONS,
+    SECD_CONSCAR, /* fused CONS CAR: (a . b . s) -> (a . s) */
     SECD_DIV,
     SECD_DUM,
     SECD_EQ,
@@ -71,6 +78,8 @@ typedef enum {
     SECD_LD,
     SECD_LDC,
     SECD_LDF,
+    SECD_LDLDADD, /* fused LD (d . i) LD (d . i) ADD */
+    SECD_LDLOC, /* LD (depth . index), a variable in a local frame */
     SECD_LEQ,
     SECD_MUL,
     SECD_PRN,
@@ -82,6 +91,7 @@ typedef enum {
     SECD_STOP,
     SECD_SUB,
     SECD_TYPE,
+    SECD_TYPEP, /* fused TYPE LDC <type> EQ: tests the type of a cell */
     SECD_LAST, // not an operation
 } opindex_t;
 
@@ -114,52 +124,80 @@ typedef cell_t* (*secd_opfunc_t)(secd_t *);
 typedef cell_t* (*secd_nativefunc_t)(secd_t *, cell_t *);
 
 struct cons {
-    cell_t *car;    // shares
-    cell_t *cdr;    // shares
+    cellref_t car;  // shares
+    cellref_t cdr;  // shares
 };
 
 struct symbol {
-    size_t size;
-    const char *data;
-    hash_t hash;
+    const char *data;   // the name of a symdata_t, see intern_symbol()
 };
 
-struct frame {
-    struct cons cons;    // must be first to cast to cons
-    cell_t *io;     // cons of *stdin* and *stdout* for the frame
+/* an interned name, never freed */
+typedef struct symdata symdata_t;
+struct symdata {
+    cell_t *cell;       // the symbol, it is never freed either
+    const symdata_t *folded;    // the first interned name equal to it by str_eq()
+    int opcode;         // the index in opcode_table, -1 if it is not an opcode
+    hash_t key;         // str_eq()-compatible hash for secd->symtab
+    hash_t hash;        // strhash() of the name
+    char name[];
 };
 
+/* CELL_FRAME is a cons of symbols and values;
+ * its I/O ports are found through the environment, see env_io() */
+
+/* free array areas of 1..ARR_SMALL cells have a class each,
+ * larger ones have a class for every power of two */
+#define ARR_SMALL   32
+#define ARR_CLASSES (ARR_SMALL + 26)
+
 struct metacons {
-    cell_t *prev;   // prev from arrlist, arrlist-ward
-    cell_t *next;   // next from arrlist, arrptr-ward
-    bool free:1;    // is area free
-    bool cells:1;   // does area contain cells
+    cellref_t prev; // prev from arrlist, arrlist-ward
+    cellref_t next; // next from arrlist, arrptr-ward
+};
+
+/* cell_t.flags */
+enum cell_flags {
+    /* CELL_ARRMETA */
+    FLAG_ARRFREE  = 1,  // is area free
+    FLAG_ARRCELLS = 2,  // does area contain cells
+    FLAG_ARRPAD_SHIFT = 2,  // unused bytes in the last cell of a byte area
+    FLAG_ARRPAD   = 0xf << FLAG_ARRPAD_SHIFT,
+
+    /* CELL_FRAME */
+    FLAG_FRAMEIO  = 1,  // binds *stdin* or *stdout*
+
+    /* CELL_PORT */
+    FLAG_PORTFILE = 1,  // as.port.file is valid, as.port.str otherwise
+    FLAG_PORTIN   = 2,
+    FLAG_PORTOUT  = 4,
+
+    /* any type, see secd_minor_gc() */
+    FLAG_FORWARDED  = 0x40, // a young cell is promoted, as.ref is its copy
+    FLAG_REMEMBERED = 0x80, // an old cell is in secd->remembered
+    FLAG_SCANNED   = 0x100, // mark & sweep has counted its references
 };
 
 struct port {
     union {
-        cell_t *str;    // owns
+        cellref_t str;  // owns
         void *file;     // owns
     } as;
-    bool file:1;
-    bool input:1;
-    bool output:1;
 };
 
 struct error {
-    size_t len;
     const char *msg; // owns
 };
 
+/* the size of a string is the size of its memory, see mem_size() */
 struct string {
-    char *data;
-    off_t offset; // bytes
-    size_t size;  // bytes
+    cellref_t data;  // the first cell of the memory
+    uint32_t offset; // bytes
 };
 
 struct array {
-    cell_t *data; // array
-    off_t offset; // cells
+    cellref_t data;  // the first cell of the memory
+    uint32_t offset; // cells
 };
 
 extern cell_t secd_out_of_memory;
@@ -170,14 +208,15 @@ cell_t *new_error(secd_t *, const char *fmt, ...);
 cell_t *new_errorv(secd_t *secd, const char *fmt, va_list va);
 cell_t *new_error_with(secd_t *secd, cell_t *preverr, const char *fmt, ...);
 
+/* a header word and a word of payload */
 struct cell {
     enum cell_type type:TYPE_BITS;
+    unsigned flags:FLAG_BITS;
     size_t nref:NREF_BITS;
 
     union {
         cons_t   cons;
         symbol_t sym;
-        frame_t  frame;
         port_t   port;
         error_t  err;
         string_t str;
@@ -186,7 +225,7 @@ struct cell {
         void    *ptr; // CELL_FUNC
         opindex_t op;
 
-        cell_t *ref;
+        cellref_t ref;
         struct metacons mcons;
     } as;
 };
@@ -195,63 +234,221 @@ typedef  struct secd_stat  secd_stat_t;
 
 typedef enum {
     SECD_NOPOST = 0,
-    SECDPOST_GC
+    SECDPOST_GC,
+    SECDPOST_MINORGC,   // the nursery is full
+    SECDPOST_AUTOGC,    // free old cells are out, cycles may hold them
+    SECDPOST_IMAGE,     // a GC and secd_write_image() to secd->image
 } secdpostop_t;
 
+/* the state of a caller saved on the dump by AP/RAP */
+struct callframe {
+    cell_t *control;    // shared
+    size_t ipoffset;    // the return point in control
+    cell_t *env;        // shared
+    size_t stackbase;   // the caller's values on the stack
+    cell_t *input_port; // the caller's I/O, held by env
+    cell_t *output_port;
+};
+
 struct secd {
     /**** memory layout ****/
-    /* pointers: begin, fixedptr, arrayptr, end
-     * - should keep the same position ordering at run-time */
+    /* pointers: begin, nurseryptr, nurseryend, fixedptr, fixedlimit,
+     * arraylimit, arrayptr, end
+     * - should keep the same position ordering at run-time;
+     * the memory between fixedlimit and arraylimit is reserved only */
     cell_t *begin;      // the first cell of the heap
 
+    /* young cells are bump-allocated from begin and are not
+     * reference-counted until promoted, see secd_minor_gc() */
+    cell_t *nurseryptr; // the next young cell
+    cell_t *nurseryend; // the first fixed cell
+    cell_t *nurserylimit;   // nurseryend unless the heap is full
+
     /* these lists reside between secd->begin and secd->fixedptr */
-    cell_t *stack;      // list
     cell_t *env;        // list
-    cell_t *control;    // list
-    cell_t *dump;       // list
+    cell_t *control;    // compiled control path
+    const instr_t *ip;  // the next instruction in control
 
     cell_t *free;       // double-linked list
     cell_t *global_env; // frame
 
     // all cells before this one are fixed-size cells
     cell_t *fixedptr;   // pointer
+    cell_t *fixedlimit; // the end of memory committed for fixed cells
 
     /* some free space between these two pointers for both to grow in */
 
+    cell_t *arraylimit; // the start of memory committed for arrays
     cell_t *arrayptr;   // pointer
     // this one and all cells after are managed memory for arrays
 
     cell_t *arrlist;    // cdr points to the double-linked list of array metaconses
 
+    /* free array areas by size class, see alloc_array() */
+    cell_t *arrfree[ARR_CLASSES];
+    uint64_t arrfree_map;   // bit i is set if arrfree[i] is not empty
+
     cell_t *end;        // the last cell of the heap
 
+    /**** the value stack ****/
+    /* an array out of the heap, every value in it is shared */
+    cell_t **stack;     // the bottom of the array
+    cell_t **stackbase; // the first value of the current function
+    cell_t **stackptr;  // the next free slot
+    cell_t **stacklimit;// the end of the array
+
+    /**** the dump ****/
+    /* an array of call frames out of the heap */
+    callframe_t *dump;      // the bottom of the array
+    callframe_t *dumpptr;   // the next free frame
+    callframe_t *dumplimit; // the end of the array
+
+    /**** the remembered set ****/
+    /* old cells and array metadata that may refer to young cells,
+     * each one shared until the next secd_minor_gc() */
+    cell_t **remembered;
+    size_t nremembered;
+    size_t remembered_size;
+    bool remembered_overflow;   // a cell did not fit, see forward_old()
+
+    /* cells to scan: promoted ones during secd_minor_gc(),
+     * counted ones during secd_mark_and_sweep_gc() */
+    cell_t **gray;
+    size_t ngray;
+    size_t gray_size;
+    bool gray_overflow;     // a counted cell did not fit, see rescan_counted()
+
+    /**** the zero count table ****/
+    /* old cells that have no counted references, the registers,
+     * the stack and the dump may refer to them; see secd_reconcile() */
+    cell_t **zct;
+    size_t nzct;
+    size_t zct_size;
+    size_t zct_limit;       // secd_reconcile() when nzct reaches it
+
+    /**** interned symbols ****/
+    symdata_t **symtab; // open addressing by symdata_t.key
+    size_t nsyms;
+    size_t symtab_size;
+
     /**** I/O ****/
-    cell_t *input_port;
+    cell_t *input_port;     // the ports of the current frame, see setup_frame()
     cell_t *output_port;
     cell_t *debug_port;
+    cell_t *default_io;     // cons of the ports for frames without *stdin*/*stdout*
+    size_t io_frames;       // frames binding *stdin*/*stdout*, may be too many
+
+    /* symbols returned by TYPE, see secd_type_sym() */
+    cell_t *type_syms[CELL_ERROR + 1];
 
     /* booleans */
     cell_t *truth_value;
     cell_t *false_value;
 
     long envcounter;
+    int envversion;     // bumped on every binding, see LD
     unsigned long tick;
 
     secdpostop_t postop;
+    FILE *image;        // to write after the instruction, see secd_save_image()
+
+    /* counts of adjacent opcode pairs, see (secd 'opstats) */
+    unsigned long *opstats;
+    opindex_t lastop;
+
+    /* the collection policy, see secd_set_gc_policy() */
+    size_t gc_min_cells;        // no automatic GC below these old cells
+    int gc_free_percent;        // of the old cells expected to be free at a GC
+    int gc_gap_percent;         // of the heap left between cells and arrays
+    size_t gc_threshold;        // old cells for the next automatic GC
+    size_t gc_gap_limit;        // cells between fixedptr and arrayptr
+    bool gc_emergency;          // the heap is full, GC_RESERVE is in use
 
     /* some statistics */
-    size_t used_stack;
-    size_t used_control;
-    size_t used_dump;
+    size_t minor_gcs;
+    size_t major_gcs;
+    size_t emergency_gcs;
+    size_t compactions;         // of the array area
+    unsigned long minor_usec;   // all of them
+    unsigned long major_usec;
+    unsigned long mark_usec;    // the last secd_mark_and_sweep_gc()
+    unsigned long sweep_usec;
+    size_t used_stack;          // the deepest value stack
+    size_t used_control;        // instructions compiled
+    size_t used_dump;           // the deepest dump
     size_t free_cells;
+    size_t freed[CELL_ERROR + 1];   // dead cells by type, see secd_stats()
+};
+
+
+/*
+ *  Immediate values
+ *  small integers, characters and booleans are not allocated:
+ *  they are encoded in cell_t * itself, tagged in its low bits;
+ *  the value is an offset from secd_heap like a cellref_t, see below
+ */
+
+/* the base is one for the process: only one secd_t may have a heap,
+ * a second init_secd() or secd_load_image() fails, see init_mem() */
+extern char *secd_heap;
+
+#define IMM_TAGBITS     2
+#define IMM_TAGMASK     ((1 << IMM_TAGBITS) - 1)
+
+enum imm_tag {
+    IMM_CELL = 0,   // a pointer to a cell, cells are aligned
+    IMM_INT,
+    IMM_CHAR,
+    IMM_BOOL,       // a symbol, #f or #t
 };
 
+inline static bool is_immediate(const cell_t *c) {
+    return ((uintptr_t)c & IMM_TAGMASK) != IMM_CELL;
+}
+inline static cell_t *make_immediate(enum imm_tag tag, intptr_t val) {
+    return (cell_t *)(secd_heap + (((uintptr_t)val << IMM_TAGBITS) | tag));
+}
+inline static intptr_t immediate_val(const cell_t *c) {
+    return ((const char *)c - secd_heap) >> IMM_TAGBITS;
+}
+/* if a number does not fit, it is allocated;
+ * the value must fit a cellref_t, see cell_ref() */
+inline static bool fits_immediate(int num) {
+    const int limit = 1 << (31 - IMM_TAGBITS);
+    return (-limit <= num) && (num < limit);
+}
+
+/* the types of immediate values by their tags */
+extern const enum cell_type secd_immediate_types[];
+
+/* NIL and immediate values are not reference-counted */
+inline static bool is_refcounted(const cell_t *c) {
+    return (c != SECD_NIL) && !is_immediate(c);
+}
+
+/*
+ *  Cell references
+ *  a cellref_t is a signed offset in bytes from secd_heap, that is
+ *  one cell before secd->begin: offset 0 is SECD_NIL, offsets with
+ *  a tag in the low bits are immediate values.
+ */
+inline static cell_t *ref_cell(cellref_t ref) {
+    if (!ref) return SECD_NIL;
+    return (cell_t *)(secd_heap + (int32_t)ref);
+}
+
+inline static cellref_t cell_ref(const cell_t *c) {
+    if (c == SECD_NIL) return 0;
+    return (const char *)c - secd_heap;
+}
 
 /*
  *  Cell accessors
  */
 
 inline static enum cell_type cell_type(const cell_t *c) {
+    if (__builtin_expect(is_immediate(c), 0))
+        return secd_immediate_types[(uintptr_t)c & IMM_TAGMASK];
     if (!c) return CELL_CONS;
     return c->type;
 }
@@ -265,15 +462,32 @@ inline static bool not_nil(const cell_t *cell) {
 }
 
 inline static long cell_index(secd_t *secd, const cell_t *cons) {
-    if (is_nil(cons)) return -1;
+    if (!is_refcounted(cons)) return -1;
     return cons - secd->begin;
 }
 
 inline static const char * symname(const cell_t *c) {
+    if (is_immediate(c))
+        return (immediate_val(c) ? SECD_TRUE : SECD_FALSE);
     return c->as.sym.data;
 }
+/* not for #t and #f */
+inline static const symdata_t *symdata(const cell_t *c) {
+    return (const symdata_t *)(c->as.sym.data - offsetof(symdata_t, name));
+}
+
+hash_t strhash(const char *strz);
 inline static hash_t symhash(const cell_t *c) {
-    return c->as.sym.hash;
+    if (is_immediate(c))
+        return strhash(symname(c));
+    return symdata(c)->hash;
+}
+
+/* symbols with names equal by str_eq() */
+inline static bool sym_eq(const cell_t *a, const cell_t *b) {
+    if (is_immediate(a) || is_immediate(b))
+        return a == b;
+    return symdata(a)->folded == symdata(b)->folded;
 }
 
 inline static const char * errmsg(const cell_t *err) {
@@ -281,13 +495,15 @@ inline static const char * errmsg(const cell_t *err) {
 }
 
 inline static int numval(const cell_t *c) {
+    if (is_immediate(c))
+        return immediate_val(c);
     return c->as.num;
 }
 inline static const char *strval(const cell_t *c) {
-    return c->as.str.data;
+    return (const char *)ref_cell(c->as.str.data);
 }
 inline static char *strmem(cell_t *c) {
-    return c->as.str.data;
+    return (char *)ref_cell(c->as.str.data);
 }
 
 void dbg_print_cell(secd_t *secd, const cell_t *c);
@@ -298,18 +514,21 @@ inline static cell_t *list_next(secd_t *secd, const cell_t *cons) {
         dbg_print_cell(secd, cons);
         return NULL;
     }
-    return cons->as.cons.cdr;
+    return ref_cell(cons->as.cons.cdr);
 }
 
 inline static cell_t *list_head(const cell_t *cons) {
-    return cons->as.cons.car;
+    return ref_cell(cons->as.cons.car);
 }
 
 inline static cell_t *get_car(const cell_t *cons) {
-    return cons->as.cons.car;
+    return ref_cell(cons->as.cons.car);
 }
 inline static cell_t *get_cdr(const cell_t *cons) {
-    return cons->as.cons.cdr;
+    return ref_cell(cons->as.cons.cdr);
+}
+inline static cell_t *get_ref(const cell_t *ref) {
+    return ref_cell(ref->as.ref);
 }
 inline static bool is_cons(const cell_t *cell) {
     if (is_nil(cell)) return true;
@@ -319,7 +538,7 @@ inline static bool is_symbol(const cell_t *cell) {
     return cell_type(cell) == CELL_SYM;
 }
 inline static bool is_number(const cell_t *cell) {
-    return cell->type == CELL_INT;
+    return cell_type(cell) == CELL_INT;
 }
 
 inline static bool is_error(const cell_t *cell) {
@@ -328,17 +547,26 @@ inline static bool is_error(const cell_t *cell) {
 }
 
 inline static bool is_input(const cell_t *port) {
-    return port->as.port.input;
+    return port->flags & FLAG_PORTIN;
 }
 inline static bool is_output(const cell_t *port) {
-    return port->as.port.output;
+    return port->flags & FLAG_PORTOUT;
+}
+inline static bool is_fileport(const cell_t *port) {
+    return port->flags & FLAG_PORTFILE;
+}
+inline static cell_t *port_str(const cell_t *port) {
+    return ref_cell(port->as.port.as.str);
 }
 
-inline static cell_t *mcons_prev(cell_t *mcons) {
-    return mcons->as.mcons.prev;
+inline static cell_t *mcons_prev(const cell_t *mcons) {
+    return ref_cell(mcons->as.mcons.prev);
+}
+inline static cell_t *mcons_next(const cell_t *mcons) {
+    return ref_cell(mcons->as.mcons.next);
 }
-inline static cell_t *mcons_next(cell_t *mcons) {
-    return mcons->as.mcons.next;
+inline static bool arrmeta_has_cells(const cell_t *mcons) {
+    return mcons->flags & FLAG_ARRCELLS;
 }
 
 #define INIT_OP(op) {       \
@@ -355,8 +583,7 @@ inline static cell_t *mcons_next(cell_t *mcons) {
     .type = CELL_ERROR,     \
     .nref = DONT_FREE_THIS, \
     .as.err = {             \
-        .msg = (txt),       \
-        .len = sizeof(txt) } }
+        .msg = (txt) } }
 
 /*
  * parser
@@ -382,12 +609,35 @@ cell_t *read_secd(secd_t *secd);
  * machine
  */
 
-secd_t * init_secd(secd_t *secd);
+/* sizes of the heap are in cells, 0 for defaults from conf.h;
+ * one machine per process, see secd_heap */
+secd_t * init_secd(secd_t *secd, size_t size, size_t maxsize);
 cell_t * run_secd(secd_t *secd, cell_t *ctrl);
+/* compiles `ctrl` and sets it to run from its start */
+cell_t * start_secd(secd_t *secd, cell_t *ctrl);
+/* runs from secd->control and secd->ip, e.g. after an image is loaded */
+cell_t * resume_secd(secd_t *secd);
+
+/* images: snapshots of the machine between instructions */
+/* (secd 'save-image path): the image is written after the instruction */
+cell_t * secd_save_image(secd_t *secd, const char *path);
+bool secd_write_image(secd_t *secd);
+/* an image of the machine about to run `ctrl`, see start_secd() */
+bool secd_save_start_image(secd_t *secd, cell_t *ctrl, const char *path);
+/* instead of init_secd(), then resume_secd() */
+secd_t * secd_load_image(secd_t *secd, const char *path);
+/* the same for images linked into the binary, e.g. "repl" */
+secd_t * secd_load_builtin(secd_t *secd, const char *name);
+
+/* compiled control paths in .secdb files, see bytecode.c */
+bool secd_save_code(secd_t *secd, cell_t *ctrl, const char *path);
+bool is_code_file(const char *path);
+cell_t * secd_load_code(secd_t *secd, const char *path);
 
 /* serialization */
 cell_t *serialize_cell(secd_t *secd, cell_t *cell);
 cell_t *secd_mem_info(secd_t *secd);
+cell_t *secd_stats(secd_t *secd);
 
 /* control path */
 bool is_control_compiled(cell_t *control);
@@ -402,8 +652,10 @@ hash_t strhash(const char *strz);
 cell_t *secd_first(secd_t *secd, cell_t *stream);
 cell_t *secd_rest(secd_t *secd, cell_t *stream);
 
-/* return a symbol describing the cell */
+/* return a symbol describing the cell, it is preallocated */
 cell_t *secd_type_sym(secd_t *secd, const cell_t *cell);
+/* the type a symbol returned by secd_type_sym() names, -1 if none */
+int secd_type_by_name(const char *name);
 
 /* in the sense of 'equal?' */
 bool is_equal(secd_t *secd, const cell_t *a, const cell_t *b);
@@ -411,10 +663,9 @@ bool is_equal(secd_t *secd, const cell_t *a, const cell_t *b);
 inline static cell_t *to_bool(secd_t *secd, bool cond) {
     return ((cond)? secd->truth_value : secd->false_value);
 }
+/* #f is immediate and so unique: no need to compare names */
 inline static bool secd_bool(secd_t *secd, cell_t *cell) {
-    if (is_symbol(cell) && (is_equal(secd, cell, secd->false_value)))
-        return false;
-    return true;
+    return cell != secd->false_value;
 }
 
 #endif //__SECD_H__
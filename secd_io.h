@@ -23,8 +23,8 @@ int secd_vprintf(secd_t *secd, cell_t *port, const char *format, va_list ap);
 
 void sexp_print_port(secd_t *secd, const cell_t *port);
 
-static inline bool is_closed(cell_t *port) {
-    return !port->as.port.input && !port->as.port.output;
+static inline bool is_closed(const cell_t *port) {
+    return !is_input(port) && !is_output(port);
 }
 
 #include "conf.h"
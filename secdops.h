@@ -1,6 +1,7 @@
 #ifndef __SECD_OPS_H__
 #define __SECD_OPS_H__
 
+#include "memory.h"
 
 typedef struct {
     const char *name;
@@ -12,6 +13,105 @@ typedef struct {
 extern const opcode_t opcode_table[];
 extern size_t opcode_count(void);
 
+/* the index of the opcode in opcode_table, -1 if there is none */
+index_t opcode_for_name(const char *name);
+
 bool compile_ctrl(secd_t *secd, cell_t **ctrl, cell_t **fvars);
 
+/* a compiled path of the instructions and constants, see below */
+cell_t *new_code(secd_t *secd, const instr_t *instrs, size_t len,
+                 cell_t **consts, size_t nconsts);
+
+/*
+ *  Compiled control paths
+ *
+ *  A compiled path is a vector: its item 0 is a bytevector of instr_t
+ *  words, other items are CELL_REFs to constants of the path.
+ *  An instruction is an opcode byte and a signed 24-bit operand:
+ *    LD, LDC, LDF - index of the constant in the vector;
+ *    SEL, JOIN    - jump relative to the next instruction;
+ *    AP           - number of arguments on the stack or AP_ARGLIST;
+ *    LDLOC        - depth of the frame and index of the variable in it;
+ *    LDLDADD      - two short LDLOC operands, INSTR_HALFBITS each;
+ *    TYPEP        - enum cell_type to test for.
+ */
+#define INSTR_OPBITS    8
+#define INSTR_HALFBITS  11
+#define AP_ARGLIST      (-1)
+
+#define LOC_DEPTHBITS       8
+#define LOC_INDEXBITS       15
+#define SHORTLOC_DEPTHBITS  4
+
+inline static instr_t make_instr(opindex_t op, int arg) {
+    return (instr_t)op | ((instr_t)arg << INSTR_OPBITS);
+}
+inline static opindex_t instr_op(instr_t instr) {
+    return (opindex_t)(instr & ((1 << INSTR_OPBITS) - 1));
+}
+inline static int instr_arg(instr_t instr) {
+    return (int32_t)instr >> INSTR_OPBITS;
+}
+
+inline static int instr_lo(int arg) {
+    return arg & ((1 << INSTR_HALFBITS) - 1);
+}
+inline static int instr_hi(int arg) {
+    return arg >> INSTR_HALFBITS;
+}
+
+/* returns -1 if the address does not fit */
+inline static int make_loc(int depth, int index) {
+    if ((depth >> LOC_DEPTHBITS) || (index >> LOC_INDEXBITS))
+        return -1;
+    return depth | (index << LOC_DEPTHBITS);
+}
+inline static int loc_depth(int loc) {
+    return loc & ((1 << LOC_DEPTHBITS) - 1);
+}
+inline static int loc_index(int loc) {
+    return loc >> LOC_DEPTHBITS;
+}
+
+/* an address in INSTR_HALFBITS, -1 if it does not fit */
+inline static int make_shortloc(int loc) {
+    int depth = loc_depth(loc);
+    int index = loc_index(loc);
+    if ((depth >> SHORTLOC_DEPTHBITS)
+        || (index >> (INSTR_HALFBITS - SHORTLOC_DEPTHBITS)))
+        return -1;
+    return depth | (index << SHORTLOC_DEPTHBITS);
+}
+inline static int shortloc_loc(int shortloc) {
+    return make_loc(shortloc & ((1 << SHORTLOC_DEPTHBITS) - 1),
+                    shortloc >> SHORTLOC_DEPTHBITS);
+}
+
+/* a global LD is followed by its inline cache in the constants:
+ * the number of frames known at compile time, the version of
+ * environment the cache is valid for and a frame cell holding
+ * the environment below the known frames and the found binding */
+#define LDCACHE_DEPTH   1
+#define LDCACHE_VERSION 2
+#define LDCACHE_ENTRY   3
+
+inline static const instr_t *code_instrs(const cell_t *code) {
+    return (const instr_t *)strval(arr_val(code, 0));
+}
+inline static cell_t *code_const(const cell_t *code, int index) {
+    return get_ref(arr_val(code, index));
+}
+
+/* counts the pair of the previous and this opcode, if enabled */
+inline static void count_opcode(secd_t *secd, opindex_t op) {
+    if (secd->lastop != SECD_LAST)
+        ++secd->opstats[ secd->lastop * SECD_LAST + op ];
+    secd->lastop = op;
+}
+
+#if (THREADED_CODE)
+/* the direct-threaded interpreter loop, see interp.c */
+cell_t *run_threaded(secd_t *secd);
+#endif
+
 #endif //__SECD_OPS_H__